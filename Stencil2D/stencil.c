@@ -1,4 +1,5 @@
 
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,9 +8,47 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <sched.h>
+#include <dirent.h>
+#include <omp.h>
 
-#include <CL/opencl.h>
+/* Noms courts de stencil.h, prives a stencil.c et stencil.cl. STORAGE
+ * peut venir de la ligne de commande (make DEFINES="-DSTORAGE=FP16"). */
+#define FP32 STENCIL_FP32
+#define FP16 STENCIL_FP16
+#define BF16 STENCIL_BF16
+#define FP64 STENCIL_FP64
+#if defined(STORAGE) && !defined(STENCIL_STORAGE)
+	#define STENCIL_STORAGE STORAGE
+#endif
+
+#include "stencil.h"
+
+#ifndef STORAGE
+	#define STORAGE STENCIL_STORAGE
+#endif
+#define NORM_MAX STENCIL_NORM_MAX
+#define NORM_L2  STENCIL_NORM_L2
+
+typedef stencil_store_t store_t;
+#if STORAGE == FP16 || STORAGE == BF16
+typedef float real_t;                   // compute type
+#elif STORAGE == FP64
+typedef double real_t;
+#else
+typedef float real_t;
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 #define TIME_DIFF(t1, t2) \
   ((t2.tv_sec - t1.tv_sec) * 1000000 + (t2.tv_usec - t1.tv_usec))
@@ -17,25 +56,39 @@
 #define MAX_DEVICES 5
 
 
-#define error(...) do { fprintf(stderr, "Error: " __VA_ARGS__); exit(EXIT_FAILURE); } while(0)
+/* Les erreurs arretent le programme. Pendant un appel de libstencil le
+ * message est le meme, mais seul l'appel est abandonne : error() et
+ * check() reviennent a son debut, qui renvoie une erreur (voir
+ * stencil.h). Les autres threads (OpenMP, points de reprise) arretent
+ * toujours le programme. */
+static __thread jmp_buf *api_error;     // set during a libstencil call
+
+__attribute__((noreturn))
+static void fail(void)
+{
+  if (api_error != NULL)
+    longjmp(*api_error, 1);
+  exit(EXIT_FAILURE);
+}
+
+#define error(...) do { fprintf(stderr, "Error: " __VA_ARGS__); fail(); } while(0)
 #define check(err, ...)					\
   do {							\
     if(err != CL_SUCCESS) {				\
       fprintf(stderr, "(%d) Error: " __VA_ARGS__, err);	\
-      exit(EXIT_FAILURE);				\
+      fail();						\
     }							\
   } while(0)
 
-size_t file_size(const char *filename) {
+static size_t file_size(const char *filename) {
 	struct stat sb;
 	if (stat(filename, &sb) < 0) {
-		perror ("stat");
-		abort ();
+		error("can not read %s\n", filename);
 	}
 	return sb.st_size;
 }
 
-char*
+static char*
 load(const char *filename) {
 	FILE *f;
 	char *b;
@@ -44,18 +97,16 @@ load(const char *filename) {
 	s = file_size (filename);
 	b = malloc (s+1);
 	if (!b) {
-		perror ("malloc");
-		exit (1);
+		error("Failed to allocate host memory!\n");
 	}
 	f = fopen (filename, "r");
 	if (f == NULL) {
-		perror ("fopen");
-		exit (1);
+		error("can not open %s\n", filename);
 	}
 	r = fread (b, s, 1, f);
+	fclose (f);
 	if (r != 1) {
-		perror ("fread");
-		exit (1);
+		error("can not read %s\n", filename);
 	}
 	b[s] = '\0';
 	return b;
@@ -67,12 +118,6 @@ load(const char *filename) {
 #ifndef YDIM
 	#define YDIM      4096
 #endif
-#define BORDER    1
-#define PADDING   ( 64/sizeof(float) - 2*BORDER )
-#define LINESIZE  ( XDIM + PADDING + 2*BORDER )
-#define OFFSET    (LINESIZE + 16)
-#define TOTALSIZE ( LINESIZE*( YDIM + 2*BORDER ) )
-
 #ifndef NUM_ITERATION
 	#define NUM_ITERATION 50
 #endif
@@ -86,353 +131,4828 @@ load(const char *filename) {
 //#define YDIM_GPU (0)
 //#define COMPUTE_TIME
 //#define YDIM_GPU (4096)
-#define YDIM_CPU (YDIM - YDIM_GPU)
-#define TOTALSIZE_GPU ( LINESIZE*(YDIM_GPU + 2*BORDER) )
-#define GPU_OFFSET LINESIZE*YDIM_CPU
 
-/* Version CPU pour comparer le resultat */
-void stencil(float* B, const float* A)
+/* Parametres du calcul en cours (voir struct stencil_params dans stencil.h) */
+#define PARAMS_DEFAULT {					\
+    .xdim = XDIM, .ydim = YDIM, .ydim_gpu = YDIM_GPU,		\
+    .num_iteration = NUM_ITERATION, .halo = 1, .time_block = 1,	\
+    .check_every = 10, .norm = NORM_MAX, .device_columns = 1,	\
+  }
+static struct stencil_params par = PARAMS_DEFAULT;
+
+void stencil_params_default(struct stencil_params *p)
 {
-  for(int y=0; y<YDIM; y++)
-    for(int x=0; x<XDIM; x++)
-      B[y*LINESIZE + x] = 0.75*A[y*LINESIZE + x] + 
-	0.25*( A[y*LINESIZE + x - 1] + A[y*LINESIZE + x + 1] +
-	       A[(y-1)*LINESIZE + x] + A[(y+1)*LINESIZE + x]);
+  const struct stencil_params defaults = PARAMS_DEFAULT;
+
+  *p = defaults;
 }
 
-void stencil_cpu(float* B, const float* A)
+#define BORDER    1
+#define PADDING   ( 64/sizeof(float) - 2*BORDER )
+#define LINESIZE  ( par.xdim + PADDING + 2*BORDER )
+#define OFFSET    (LINESIZE + 16)
+#define TOTALSIZE ( LINESIZE*( par.ydim + 2*BORDER ) )
+
+/* Alignement des grilles de l'hote : une page, pour que les runtimes
+ * OpenCL puissent les utiliser en place (--zero-copy) */
+#define HOST_ALIGN 4096
+
+/* Le partage CPU/GPU se fait par paquets de 16 lignes (4 lignes par
+ * work-item, 4 work-items par work-group) */
+#define SPLIT_STEP 16
+#define ROUND_UP(n, step) ( ((n) + (step) - 1) / (step) * (step) )
+
+/* Les colonnes de la grille des devices (--device-columns) se coupent
+ * par paquets de 64 points, la largeur d'un work-group du noyau
+ * fusionne */
+#define COL_STEP 64
+
+#ifndef STENCIL_LIBRARY
+static const char *storage_names[] = { "fp32", "fp16", "bf16", "fp64" };
+#endif
+
+/* Conversions float <-> half IEEE, arrondi au plus pres (pair en cas
+ * d'egalite), sous-normaux compris */
+static inline uint16_t float_to_half(float f)
 {
-  #pragma omp parallel for num_threads(14)
-  for(int y=0; y<YDIM_CPU; y++)
-    #pragma omp parallel for
-    for(int x=0; x<XDIM; x++)
-      B[y*LINESIZE + x] = 0.75*A[y*LINESIZE + x] + 
-	0.25*( A[y*LINESIZE + x - 1] + A[y*LINESIZE + x + 1] +
-	       A[(y-1)*LINESIZE + x] + A[(y+1)*LINESIZE + x]);
+  uint32_t u, mant, h, rem, tie;
+  int exp;
+
+  memcpy(&u, &f, sizeof(u));
+  h = (u >> 16) & 0x8000;
+  exp = (int)((u >> 23) & 0xff) - 127 + 15;
+  mant = u & 0x7fffff;
+  if (((u >> 23) & 0xff) == 0xff)       // Inf, NaN
+    return h | 0x7c00 | (mant ? 0x200 : 0);
+  if (exp >= 31)
+    return h | 0x7c00;
+  if (exp <= 0) {                       // subnormal or zero
+    if (exp < -10)
+      return h;
+    mant |= 0x800000;
+    rem = mant & ((1u << (14 - exp)) - 1);
+    tie = 1u << (13 - exp);
+    h |= mant >> (14 - exp);
+  } else {
+    rem = mant & 0x1fff;
+    tie = 0x1000;
+    h |= (uint32_t)exp << 10 | mant >> 13;
+  }
+  // A carry out of the mantissa correctly bumps the exponent
+  if (rem > tie || (rem == tie && (h & 1)))
+    h++;
+  return h;
 }
 
-int main(int argc, char** argv)
+static inline float half_to_float(uint16_t h)
 {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f, mant = h & 0x3ff, u;
+  float f;
 
-  cl_platform_id	pf[3];
-  cl_uint nb_platforms = 0;
-  cl_uint p = 0;
+  if (exp == 0x1f)
+    u = sign | 0x7f800000 | mant << 13;
+  else if (exp != 0)
+    u = sign | (exp + 127 - 15) << 23 | mant << 13;
+  else if (mant == 0)
+    u = sign;
+  else {                                // subnormal, normalized in float
+    exp = 127 - 15 + 1;
+    while (!(mant & 0x400)) {
+      mant <<= 1;
+      exp--;
+    }
+    u = sign | exp << 23 | (mant & 0x3ff) << 13;
+  }
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
 
-  cl_context context;                 // compute context
-  cl_program program;                 // compute program
-  cl_int err;                            // error code returned from api calls
-    
-  cl_device_id devices[MAX_DEVICES];
-  cl_uint nb_devices = 0;
+/* bfloat16 : les 16 bits de poids fort d'un float, arrondis au plus pres */
+static inline uint16_t float_to_bf16(float f)
+{
+  uint32_t u;
 
-  cl_device_type device_type = CL_DEVICE_TYPE_ALL;
+  memcpy(&u, &f, sizeof(u));
+  return (u + 0x7fff + ((u >> 16) & 1)) >> 16;
+}
 
-  cl_mem d_idata;                       // device memory used for first matrix
-  cl_mem d_odata;                       // device memory used for result matrix
-  cl_int dev;
+static inline float bf16_to_float(uint16_t b)
+{
+  uint32_t u = (uint32_t)b << 16;
+  float f;
 
-  const unsigned int line_size = LINESIZE;
-  const unsigned int mem_size = TOTALSIZE*sizeof(float);
-  const unsigned int mem_size_gpu = TOTALSIZE_GPU*sizeof(float);
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
 
-  float *h_refdata = NULL;
-  float *h_idata = NULL;
-  float *h_odata = NULL;
+static inline real_t load_point(store_t v)
+{
+#if STORAGE == FP16
+  return half_to_float(v);
+#elif STORAGE == BF16
+  return bf16_to_float(v);
+#else
+  return v;
+#endif
+}
 
-  struct timeval tv1,tv2;
-  struct timeval tvCPU1,tvCPU2;
-  struct timeval tvGPU1,tvGPU2;
+static inline store_t store_point(real_t v)
+{
+#if STORAGE == FP16
+  return float_to_half(v);
+#elif STORAGE == BF16
+  return float_to_bf16(v);
+#else
+  return v;
+#endif
+}
 
-  // Filter args
-  //
-  argv++;
-  while (argc > 1) {
-    if(!strcmp(*argv, "--gpu-only")) {
-      if(device_type != CL_DEVICE_TYPE_ALL)
-	error("--gpu-only and --cpu-only can not be specified at the same time\n");
-      device_type = CL_DEVICE_TYPE_GPU;
-    } else if(!strcmp(*argv, "--cpu-only")) {
-      if(device_type != CL_DEVICE_TYPE_ALL)
-	error("--gpu-only and --cpu-only can not be specified at the same time\n");
-      device_type = CL_DEVICE_TYPE_CPU;
-    } else
-      break;
-    argc--; argv++;
+/* Une ligne de la version de reference. Ses variantes (--validate)
+ * passent toutes par elle : meme resultat au bit pres. */
+static inline void reference_row(float *b, const float *a, int xdim, int line_size)
+{
+  #pragma omp simd
+  for(int x=0; x<xdim; x++)
+    b[x] = 0.75*a[x] +
+      0.25*( a[x - 1] + a[x + 1] + a[x - line_size] + a[x + line_size]);
+}
+
+#ifndef STENCIL_LIBRARY
+/* Version CPU pour comparer le resultat */
+static void stencil(float* B, const float* A)
+{
+  for(int y=0; y<par.ydim; y++)
+    reference_row(B + y*LINESIZE, A + y*LINESIZE, par.xdim, LINESIZE);
+}
+#endif
+
+/* Noyaux CPU d'une ligne, vectorises en simple precision. Les lignes sont alignees
+ * sur 64 octets (OFFSET et LINESIZE multiples de 16 floats, grilles
+ * allouees alignees) et leur largeur est un multiple de 16 : seuls les
+ * voisins x-1 et x+1 sont lus sans alignement. Les resultats sont
+ * ecrits en non-temporel quand stream est vrai (balayage complet, la
+ * partie CPU ne tient pas en cache), normalement sinon (pavage temporel,
+ * la ligne est relue aussitot).
+ * Le noyau scalaire garde l'arithmetique de stencil() : meme resultat au
+ * bit pres que la version de reference. C'est aussi le seul qui traite
+ * tous les formats de STORAGE ; les noyaux vectoriels sont en FP32, plus
+ * celui en FP16 (conversions F16C). */
+static void stencil_row_scalar(store_t *b, const store_t *a, int xdim, int line_size, int stream)
+{
+  (void)stream;
+  for(int x=0; x<xdim; x++)
+    b[x] = store_point(0.75*load_point(a[x]) +
+      0.25*( load_point(a[x - 1]) + load_point(a[x + 1]) +
+	     load_point(a[x - line_size]) + load_point(a[x + line_size]) ));
+}
+
+#if defined(HAVE_X86_SIMD) && STORAGE == FP16
+__attribute__((target("avx2,f16c")))
+static void stencil_row_f16c(store_t *b, const store_t *a, int xdim, int line_size, int stream)
+{
+  const __m256 c = _mm256_set1_ps(0.75f), n = _mm256_set1_ps(0.25f);
+#define LOAD_PH(p) _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(p)))
+
+  for(int x=0; x<xdim; x+=8) {
+    __m256 s = _mm256_add_ps(LOAD_PH(a + x - 1), LOAD_PH(a + x + 1));
+    s = _mm256_add_ps(s, LOAD_PH(a + x - line_size));
+    s = _mm256_add_ps(s, LOAD_PH(a + x + line_size));
+    __m256 r = _mm256_add_ps(_mm256_mul_ps(c, LOAD_PH(a + x)), _mm256_mul_ps(n, s));
+    __m128i h = _mm256_cvtps_ph(r, _MM_FROUND_TO_NEAREST_INT);
+    // Lines are 32-byte aligned only: 16-byte stores
+    if (stream)
+      _mm_stream_si128((__m128i *)(b + x), h);
+    else
+      _mm_store_si128((__m128i *)(b + x), h);
   }
+#undef LOAD_PH
+}
+#endif
 
-  // Allocation of input & output matrices
-  //
-  h_refdata = malloc(mem_size);
-  h_idata = malloc(mem_size);
-  h_odata = malloc(mem_size);
+#if defined(HAVE_X86_SIMD) && STORAGE == FP32
+__attribute__((target("sse2")))
+static void stencil_row_sse(float *b, const float *a, int xdim, int line_size, int stream)
+{
+  const __m128 c = _mm_set1_ps(0.75f), n = _mm_set1_ps(0.25f);
 
-  // Initialization of input & output matrices
-  //
-  srand(1234);
-  for(unsigned int i = 0; i < TOTALSIZE; i++) {
-    h_idata[i]=rand();
-    h_refdata[i]=h_idata[i];
-    h_odata[i]=h_idata[i];
+  for(int x=0; x<xdim; x+=4) {
+    __m128 s = _mm_add_ps(_mm_loadu_ps(a + x - 1), _mm_loadu_ps(a + x + 1));
+    s = _mm_add_ps(s, _mm_load_ps(a + x - line_size));
+    s = _mm_add_ps(s, _mm_load_ps(a + x + line_size));
+    __m128 r = _mm_add_ps(_mm_mul_ps(c, _mm_load_ps(a + x)), _mm_mul_ps(n, s));
+    if (stream)
+      _mm_stream_ps(b + x, r);
+    else
+      _mm_store_ps(b + x, r);
   }
+}
 
-  // Get list of OpenCL platforms detected
-  //
-  err = clGetPlatformIDs(3, pf, &nb_platforms);
-  check(err, "Failed to get platform IDs");
+__attribute__((target("avx2")))
+static void stencil_row_avx2(float *b, const float *a, int xdim, int line_size, int stream)
+{
+  const __m256 c = _mm256_set1_ps(0.75f), n = _mm256_set1_ps(0.25f);
 
-  if (!QUIET) printf("%d OpenCL platforms detected\n", nb_platforms);
+  for(int x=0; x<xdim; x+=8) {
+    __m256 s = _mm256_add_ps(_mm256_loadu_ps(a + x - 1), _mm256_loadu_ps(a + x + 1));
+    s = _mm256_add_ps(s, _mm256_load_ps(a + x - line_size));
+    s = _mm256_add_ps(s, _mm256_load_ps(a + x + line_size));
+    __m256 r = _mm256_add_ps(_mm256_mul_ps(c, _mm256_load_ps(a + x)), _mm256_mul_ps(n, s));
+    if (stream)
+      _mm256_stream_ps(b + x, r);
+    else
+      _mm256_store_ps(b + x, r);
+  }
+}
 
-  // Print name & vendor for each platform
-  //
-  for (unsigned int _p=0; _p<nb_platforms; _p++) {
-    cl_uint num;
-    int platform_valid = 1;
-    char name[1024], vendor[1024];
+__attribute__((target("avx512f")))
+static void stencil_row_avx512(float *b, const float *a, int xdim, int line_size, int stream)
+{
+  const __m512 c = _mm512_set1_ps(0.75f), n = _mm512_set1_ps(0.25f);
 
-    err = clGetPlatformInfo(pf[_p], CL_PLATFORM_NAME, 1024, name, NULL);
-    check(err, "Failed to get Platform Info");
+  for(int x=0; x<xdim; x+=16) {
+    __m512 s = _mm512_add_ps(_mm512_loadu_ps(a + x - 1), _mm512_loadu_ps(a + x + 1));
+    s = _mm512_add_ps(s, _mm512_load_ps(a + x - line_size));
+    s = _mm512_add_ps(s, _mm512_load_ps(a + x + line_size));
+    __m512 r = _mm512_add_ps(_mm512_mul_ps(c, _mm512_load_ps(a + x)), _mm512_mul_ps(n, s));
+    if (stream)
+      _mm512_stream_ps(b + x, r);
+    else
+      _mm512_store_ps(b + x, r);
+  }
+}
+#endif
 
-    err = clGetPlatformInfo(pf[_p], CL_PLATFORM_VENDOR, 1024, vendor, NULL);
-    check(err, "Failed to get Platform Info");
+struct cpu_kernel {
+  const char *name;
+  void (*row)(store_t *b, const store_t *a, int xdim, int line_size, int stream);
+};
 
-    if (!QUIET) printf("Platform %d: %s - %s\n", _p, name, vendor);
+static const struct cpu_kernel cpu_kernels[] = {
+#if defined(HAVE_X86_SIMD) && STORAGE == FP32
+  { "avx512", stencil_row_avx512 },
+  { "avx2", stencil_row_avx2 },
+  { "sse", stencil_row_sse },
+#endif
+#if defined(HAVE_X86_SIMD) && STORAGE == FP16
+  { "f16c", stencil_row_f16c },
+#endif
+  { "scalar", stencil_row_scalar },
+};
+#define NB_CPU_KERNELS (sizeof(cpu_kernels)/sizeof(cpu_kernels[0]))
 
-    if(strstr(vendor, "NVIDIA")) {
-      p = _p;
-      if (!QUIET) printf("Choosing platform %d\n", p);
+static const struct cpu_kernel *cpu_kernel = NULL;
+
+static int cpu_kernel_supported(const struct cpu_kernel *k)
+{
+#if defined(HAVE_X86_SIMD) && STORAGE == FP32
+  if (k->row == stencil_row_avx512)
+    return __builtin_cpu_supports("avx512f");
+  if (k->row == stencil_row_avx2)
+    return __builtin_cpu_supports("avx2");
+  if (k->row == stencil_row_sse)
+    return __builtin_cpu_supports("sse2");
+#endif
+#if defined(HAVE_X86_SIMD) && STORAGE == FP16
+  if (k->row == stencil_row_f16c)
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+#endif
+  (void)k;  // BF16 and FP64 only have the scalar kernel
+  return 1;
+}
+
+/* Choix du noyau CPU : le plus large supporte par le processeur (CPUID),
+ * ou celui demande par son nom */
+static void select_cpu_kernel(const char *name)
+{
+  for(unsigned int k = 0; k < NB_CPU_KERNELS; k++) {
+    if (name != NULL && strcmp(name, cpu_kernels[k].name))
+      continue;
+    if (!cpu_kernel_supported(&cpu_kernels[k])) {
+      if (name != NULL)
+	error("the %s CPU kernel is not supported by this processor\n", name);
+      continue;
     }
+    cpu_kernel = &cpu_kernels[k];
+    return;
   }
+  error("unknown CPU kernel \"%s\"\n", name);
+}
 
-  // Get list of devices
-  //
-  err = clGetDeviceIDs(pf[p], device_type, MAX_DEVICES, devices, &nb_devices);
-  if (!QUIET) printf("nb devices = %d\n", nb_devices);
+/* Trace (--trace FILE) : chaque lancement et chaque transfert est date
+ * par les evenements de profiling d'OpenCL, chaque calcul CPU par
+ * l'horloge de l'hote. Le fichier est au format Chrome/Perfetto
+ * (chrome://tracing, ui.perfetto.dev) ; a la fin de chaque calcul un
+ * resume donne le temps de chaque phase et les temps morts par file. */
+enum { PHASE_KERNEL, PHASE_H2D, PHASE_D2H, PHASE_CPU, NB_PHASES };
+static const char *phase_names[NB_PHASES] = { "kernel", "H2D", "D2H", "CPU" };
 
-  // Create compute context with "device_type" devices
-  //
-  context = clCreateContext (0, nb_devices, devices, NULL, NULL, &err);
-  check(err, "Failed to create compute context");
+#define MAX_TRACKS   (1 + 2*MAX_DEVICES)  // the CPU, then two queues per device
+#define MAX_PENDING  1024
 
-  // Load program source
-  const char	*opencl_prog;
-  opencl_prog = load("stencil.cl");
+static struct {
+  FILE *file;                           // NULL when not tracing
+  int nb_records;
+  double origin;                        // host time of the first run, ns
+  double run_start;
+  int nb_tracks;
+  char track_names[MAX_TRACKS][32];
+  cl_command_queue queues[MAX_TRACKS];
+  double offset[MAX_TRACKS];            // host minus device clock, ns
+  double busy[MAX_TRACKS][NB_PHASES];   // during the current run, ns
+  struct {
+    cl_event event;
+    int track, phase;
+    const char *name;
+    double host;                        // host time just after the enqueue
+  } pending[MAX_PENDING];
+  int nb_pending;
+} trace;
 
-  // Build program
-  //
-  program = clCreateProgramWithSource(context, 1, &opencl_prog, NULL, &err);
-  check(err, "Failed to create program");
+static double trace_now(void)
+{
+  struct timespec t;
 
-  err = clBuildProgram (program, 0, NULL, NULL, NULL, NULL);
-  check(err, "Failed to build program");
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1e9 + t.tv_nsec;
+}
 
-  // Create the input and output buffers in device memory for our calculation
-  //
-  d_idata = clCreateBuffer(context, CL_MEM_READ_WRITE, mem_size_gpu, NULL, NULL);
-  if (!d_idata)
-    error("Failed to allocate device memory!\n");
+#ifndef STENCIL_LIBRARY
+static void trace_open(const char *file)
+{
+  if ((trace.file = fopen(file, "w")) == NULL)
+    error("can not open %s\n", file);
+  fprintf(trace.file, "{\"traceEvents\":[");
+  strcpy(trace.track_names[0], "CPU");
+  trace.nb_tracks = 1;
+}
+
+static void trace_close(void)
+{
+  if (trace.file == NULL)
+    return;
+  for(int t = 0; t < trace.nb_tracks; t++)
+    fprintf(trace.file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+	    "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", trace.nb_records++ ? "," : "",
+	    t, trace.track_names[t]);
+  fprintf(trace.file, "\n]}\n");
+  fclose(trace.file);
+  trace.file = NULL;
+}
+#endif
 
-  d_odata = clCreateBuffer(context, CL_MEM_READ_WRITE, mem_size_gpu, NULL, NULL);
-  if (!d_odata)
-    error("Failed to allocate device memory!\n");
+/* Ecriture d'une commande ou d'un calcul, en ns sur l'horloge de l'hote */
+static void trace_record(int track, int phase, const char *name, double start, double end)
+{
+  fprintf(trace.file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,"
+	  "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", trace.nb_records++ ? "," : "",
+	  name, phase_names[phase], track, (start - trace.origin)/1000, (end - start)/1000);
+  trace.busy[track][phase] += end - start;
+}
 
-  // Iterate over devices
-  //
-  for(dev = 0; dev < nb_devices; dev++) {
-    cl_command_queue queue;
-    cl_kernel kernel;
+/* File de commandes d'un device, tracee sous le nom name. Les files des
+ * calculs suivants reprennent la meme ligne. */
+static void trace_queue(cl_command_queue queue, const char *name)
+{
+  int t;
 
-    char name[1024];
-    err = clGetDeviceInfo(devices[dev], CL_DEVICE_NAME, 1024, name, NULL);
-    check(err, "Cannot get type of device");
+  if (trace.file == NULL)
+    return;
+  for(t = 1; t < trace.nb_tracks; t++)
+    if (!strcmp(trace.track_names[t], name))
+      break;
+  if (t == trace.nb_tracks) {
+    if (t == MAX_TRACKS)
+      error("too many queues to trace\n");
+    snprintf(trace.track_names[t], sizeof(trace.track_names[t]), "%s", name);
+    trace.offset[t] = INFINITY;
+    trace.nb_tracks++;
+  }
+  trace.queues[t] = queue;
+}
 
-    if (!QUIET) printf("Device %d : [%s]\n", dev, name);
+/* Lecture des dates des commandes en attente. Sans wait, seules celles
+ * qui sont terminees sont lues. */
+static void trace_flush(int wait)
+{
+  int kept = 0;
 
-    // Create a command queue
-    //
-    queue = clCreateCommandQueue(context, devices[dev], CL_QUEUE_PROFILING_ENABLE, &err);
-    check(err,"Failed to create a command queue!\n");
+  // The device clocks are set on the host one by the smallest delay
+  // between a command being queued and the enqueue call returning
+  for(int p = 0; p < trace.nb_pending; p++) {
+    cl_ulong queued;
+    int t = trace.pending[p].track;
 
-    // Here, we can distinguish between CPU and GPU devices so as
-    // to use different kernels, different work group size, etc.
-    {
-      size_t global[2];                      // global domain size for our calculation
-      size_t local[2];                       // local domain size for our calculation
+    clGetEventProfilingInfo(trace.pending[p].event, CL_PROFILING_COMMAND_QUEUED,
+			    sizeof(queued), &queued, NULL);
+    if (trace.pending[p].host - queued < trace.offset[t])
+      trace.offset[t] = trace.pending[p].host - queued;
+  }
+  for(int p = 0; p < trace.nb_pending; p++) {
+    cl_event event = trace.pending[p].event;
+    int t = trace.pending[p].track;
+    cl_int status;
+    cl_ulong start, end;
 
-      // Create the compute kernel in the program we wish to run
-      //
-      kernel = clCreateKernel(program, "stencil", &err);
-      check(err, "Failed to create compute kernel!\n");
+    if (wait)
+      clWaitForEvents(1, &event);
+    clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+    if (status != CL_COMPLETE) {
+      trace.pending[kept++] = trace.pending[p];
+      continue;
+    }
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+    trace_record(t, trace.pending[p].phase, trace.pending[p].name,
+		 start + trace.offset[t], end + trace.offset[t]);
+    clReleaseEvent(event);
+  }
+  trace.nb_pending = kept;
+}
 
-      // Write our data sets into the device memory
-      //
-      err = clEnqueueWriteBuffer(queue, d_idata, CL_TRUE, 0,
-				 mem_size_gpu, h_idata+GPU_OFFSET, 0, NULL, NULL);
-      check(err, "Failed to transfer input matrix!\n");
-
-      err = clEnqueueWriteBuffer(queue, d_odata, CL_TRUE, 0,
-				 mem_size_gpu, h_odata+GPU_OFFSET, 0, NULL, NULL);
-      check(err, "Failed to transfer input matrix!\n");
-
-      global[0] = XDIM;
-      global[1] = YDIM_GPU/4;
-      local[0] = 16; // Set workgroup size
-      local[1] = 4;
-
-      int numIterations = NUM_ITERATION;
-
-      gettimeofday(&tv1, NULL);
-      for(int i = 0; i<numIterations; i++) // Iterations are done inside the kernel
-      {
-        // Set the arguments to our compute kernel
-        //
-      	err = 0;
-	if (i % 2 == 0) {
-		err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_odata);
-		err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_idata);
-	}
-	else {
-		err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_idata);
-		err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_odata);
-	}
-        err |= clSetKernelArg(kernel, 2, sizeof(unsigned int), &line_size);
-        check(err, "Failed to set kernel arguments! %d\n", err);
+/* Evenement a passer a une commande : le sien, ou un local si elle n'en
+ * demande pas et que l'on trace */
+static cl_event *trace_event(cl_event *event, cl_event *local)
+{
+  *local = NULL;
+  return (event != NULL || trace.file == NULL) ? event : local;
+}
 
-	//Compute on GPU lower part
-      	gettimeofday(&tvGPU1, NULL);
-	err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global, local, 0, NULL, NULL);
-	check(err, "Failed to execute kernel!\n");
+/* Commande qui vient d'etre mise dans la file queue, avec son evenement
+ * (event) ou l'evenement local de trace_event() */
+static void trace_command(cl_command_queue queue, int phase, const char *name,
+			  const cl_event *event, cl_event local)
+{
+  double host = trace_now();
+  int t;
 
-#ifdef COMPUTE_TIME
-	// Wait for the command commands to get serviced before reading back results
-	clFinish(queue);
-      	gettimeofday(&tvGPU2, NULL);
-#endif
-	
-	//Compute on CPU upper part
-      	gettimeofday(&tvCPU1, NULL);
-	if (i % 2 == 1) {
-		stencil_cpu(h_idata + OFFSET, h_odata + OFFSET);
-	}
-	else {
-		stencil_cpu(h_odata + OFFSET, h_idata + OFFSET);
-	}
-      	gettimeofday(&tvCPU2, NULL);
-	
-#ifndef COMPUTE_TIME
-	// Wait for the command commands to get serviced before reading back results
-	clFinish(queue);
-      	gettimeofday(&tvGPU2, NULL);
-#endif
-
-	//Propagation des bords
-	if (YDIM_GPU != 0 && YDIM_GPU != YDIM) {
-		if (i % 2 == 0) {
-			err = clEnqueueReadBuffer(queue, d_odata, CL_TRUE, (sizeof(float)*LINESIZE),
-						(sizeof(float)*LINESIZE), h_odata+GPU_OFFSET+LINESIZE, 0, NULL, NULL );
-			check(err, "Failed to read matrix! %d\n", err);
-			err = clEnqueueWriteBuffer(queue, d_odata, CL_TRUE, 0,
-						 (sizeof(float)*LINESIZE), h_odata+GPU_OFFSET, 0, NULL, NULL);
-			check(err, "Failed to write matrix!\n");
-		}
-		else {
-			err = clEnqueueReadBuffer(queue, d_idata, CL_TRUE, (sizeof(float)*LINESIZE),
-						(sizeof(float)*LINESIZE), h_idata+GPU_OFFSET+LINESIZE, 0, NULL, NULL );
-			check(err, "Failed to read matrix! %d\n", err);
-			err = clEnqueueWriteBuffer(queue, d_idata, CL_TRUE, 0,
-						 (sizeof(float)*LINESIZE), h_idata+GPU_OFFSET, 0, NULL, NULL);
-			check(err, "Failed to write matrix!\n");
-		}
-	}
-      }
-      if (numIterations % 2 == 0) {
-	float* tmp = h_idata;
-	h_idata = h_odata;
-	h_odata = tmp;
-      }
+  if (trace.file == NULL)
+    return;
+  if (event != NULL) {
+    local = *event;
+    clRetainEvent(local);
+  }
+  for(t = 1; t < trace.nb_tracks && trace.queues[t] != queue; t++)
+    ;
+  if (trace.nb_pending == MAX_PENDING)
+    trace_flush(0);
+  if (trace.nb_pending == MAX_PENDING)
+    trace_flush(1);
+  trace.pending[trace.nb_pending].event = local;
+  trace.pending[trace.nb_pending].track = (t < trace.nb_tracks) ? t : 0;
+  trace.pending[trace.nb_pending].phase = phase;
+  trace.pending[trace.nb_pending].name = name;
+  trace.pending[trace.nb_pending].host = host;
+  trace.nb_pending++;
+}
 
-      gettimeofday(&tv2, NULL);
-      float time1=((float)TIME_DIFF(tv1,tv2)) / 1000;
-      float timeCPU=((float)TIME_DIFF(tvCPU1,tvCPU2)) / 1000;
-      float timeGPU=((float)TIME_DIFF(tvGPU1,tvGPU2)) / 1000;
+/* Calcul CPU commence a la date start */
+static void trace_cpu(const char *name, double start)
+{
+  if (trace.file != NULL)
+    trace_record(0, PHASE_CPU, name, start, trace_now());
+}
 
-      // Read back the results from the device to verify the output
-      //
-      if (numIterations % 2 == 1) {
-      	err = clEnqueueReadBuffer(queue, d_odata, CL_TRUE, (sizeof(float)*LINESIZE),
-				mem_size_gpu-(sizeof(float)*LINESIZE), h_odata+GPU_OFFSET+LINESIZE, 0, NULL, NULL );
-      }
-      else {
-      	err = clEnqueueReadBuffer(queue, d_idata, CL_TRUE, (sizeof(float)*LINESIZE),
-				mem_size_gpu-(sizeof(float)*LINESIZE), h_odata+GPU_OFFSET+LINESIZE, 0, NULL, NULL );
-      }
-      check(err, "Failed to read output matrix! %d\n", err);
+static void trace_begin(void)
+{
+  if (trace.file == NULL)
+    return;
+  trace.run_start = trace_now();
+  if (trace.origin == 0)
+    trace.origin = trace.run_start;
+  memset(trace.busy, 0, sizeof(trace.busy));
+}
 
-      /* Version cpu pour comparaison */
-      float* reference = (float*) malloc(mem_size);
-      for(unsigned int i = 0; i < TOTALSIZE; i++)
-	reference[i] = h_refdata[i];
+/* Fin d'un calcul : les commandes sont terminees, resume par phase */
+static void trace_end(void)
+{
+  double span;
 
-      gettimeofday(&tv1,NULL);
+  if (trace.file == NULL)
+    return;
+  span = trace_now() - trace.run_start;
+  trace_flush(1);
 
-      for(int i=0;i<numIterations;i++) {
-	if (i % 2 == 1) {
-		stencil(h_refdata + OFFSET, reference + OFFSET);
-	}
-	else {
-		stencil(reference + OFFSET, h_refdata + OFFSET);
-	}
-      }
-      if (numIterations % 2 == 0) {
-	float* tmp = h_refdata;
-        h_refdata = reference;
-	reference = tmp;
-      }
+  // On stderr, stdout may hold the --bench results
+  fprintf(stderr, "Trace: %.3f ms\n%-24s", span/1e6, "");
+  for(int phase = 0; phase < NB_PHASES; phase++)
+    fprintf(stderr, "%10s", phase_names[phase]);
+  fprintf(stderr, "%10s\n", "idle");
+  for(int t = 0; t < trace.nb_tracks; t++) {
+    double idle = span;
 
-      gettimeofday(&tv2,NULL);
-      float time2=((float)TIME_DIFF(tv1,tv2)) / 1000;
+    fprintf(stderr, "%-24s", trace.track_names[t]);
+    for(int phase = 0; phase < NB_PHASES; phase++) {
+      fprintf(stderr, "%10.3f", trace.busy[t][phase]/1e6);
+      idle -= trace.busy[t][phase];
+    }
+    fprintf(stderr, "%10.3f\n", (idle > 0 ? idle : 0)/1e6);
+  }
+  for(int t = 0; t < trace.nb_tracks; t++)
+    trace.queues[t] = NULL;
+}
 
-      if (!QUIET) printf("%f\t%f ms (%fGo/s)\t%f ms (%fGo/s)\n", time2/time1,
-	     time1, numIterations * 3*mem_size / time1 / 1000000,
-	     time2, numIterations * 3*mem_size / time2 / 1000000);
-      else printf("%f\n", time2/time1);
-#ifdef COMPUTE_TIME
-      if (!QUIET) printf("TimeGPU = %f ms, TimeCPU = %f ms ==> TimeLost = %f ms\n", timeGPU, timeCPU, timeGPU-timeCPU);
+/* Arene des grilles de l'hote (--huge-pages) : grilles, grilles de la
+ * reference, du lot et copies des sauvegardes. Chaque bloc est projete
+ * par mmap(), aligne sur HUGE_PAGE et d'une taille multiple de HUGE_PAGE :
+ * une grille de 4096x4096 tient dans 32 pages de 2 Mio au lieu de 16384
+ * pages de 4 Kio, la TLB la couvre. Avec thp le noyau y met ses pages
+ * enormes transparentes (madvise), avec explicit les blocs viennent du
+ * pool de pages enormes reserve (MAP_HUGETLB), ou de thp s'il est vide.
+ * Les lignes commencent sur 64 octets en FP32 et FP64 (LINESIZE est un
+ * multiple de 16 points), 32 en FP16 et BF16.
+ * Un bloc libere reste projete et sert a l'allocation suivante de taille
+ * voisine : les plans et les points de --bench ne refont ni les
+ * projections ni les fautes de page. Une allocation qu'aucun bloc libre
+ * ne sert rend d'abord les blocs libres au systeme. */
+enum { HUGE_NONE = STENCIL_HUGE_NONE, HUGE_THP = STENCIL_HUGE_THP,
+       HUGE_EXPLICIT = STENCIL_HUGE_EXPLICIT };
+#ifndef STENCIL_LIBRARY
+static const char *huge_names[] = { "none", "thp", "explicit" };
 #endif
+#define HUGE_PAGE    (2UL << 20)
+#define ARENA_BLOCKS 64
 
-      // Validate our results
-      //
-      unsigned int errors=0;
-      if (!QUIET) printf("TOTALSIZE = %lu\n", TOTALSIZE);
-      if (!QUIET) printf("TOTALSIZE_GPU = %lu\n", TOTALSIZE_GPU);
-      if (!QUIET) printf("LINESIZE = %lu\n", LINESIZE);
-      for(unsigned int i=0;i<TOTALSIZE;i++){
-	if((reference[i]-h_odata[i])/reference[i] > 1e-6) {
-	  if(errors < 10) printf("[%d] %f vs %f\n", i, h_odata[i], reference[i]);
-	  errors++;
-	}
-      }
-      if(errors)
-	fprintf(stderr,"%d erreurs !\n", errors);
-      else
-	if (!QUIET) fprintf(stderr,"pas d'erreurs, cool !\n");
+static struct {
+  int huge;                             // --huge-pages
+  int nb;
+  struct {
+    void *p;
+    size_t size;
+    int used;
+  } blocks[ARENA_BLOCKS];
+} arena = { .huge = HUGE_THP };
+
+static void *arena_alloc(size_t size)
+{
+  size_t page = (arena.huge == HUGE_NONE) ? (size_t)sysconf(_SC_PAGESIZE) : HUGE_PAGE;
+  int best = -1;
+  void *p = MAP_FAILED;
 
-      clReleaseKernel(kernel);
+  size = ROUND_UP(size, page);
+  // The smallest free block that fits, unless it is twice too large
+  for(int b = 0; b < arena.nb; b++)
+    if (!arena.blocks[b].used && arena.blocks[b].size >= size && arena.blocks[b].size < 2*size &&
+	(best < 0 || arena.blocks[b].size < arena.blocks[best].size))
+      best = b;
+  if (best >= 0) {
+    arena.blocks[best].used = 1;
+    return arena.blocks[best].p;
+  }
 
-      free(reference);
+  for(int b = 0; b < arena.nb; b++)
+    if (!arena.blocks[b].used) {
+      munmap(arena.blocks[b].p, arena.blocks[b].size);
+      arena.blocks[b--] = arena.blocks[--arena.nb];
     }
+  if (arena.nb == ARENA_BLOCKS)
+    error("more than %d host grids\n", ARENA_BLOCKS);
 
-      clReleaseCommandQueue(queue);
+#ifdef MAP_HUGETLB
+  if (arena.huge == HUGE_EXPLICIT) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+      if (!QUIET) printf("Huge pages: none reserved, transparent ones instead\n");
+      arena.huge = HUGE_THP;
+    }
   }
+#endif
+  if (p == MAP_FAILED) {
+    // Over-allocated by a huge page, then trimmed to its alignment
+    size_t extra = (arena.huge == HUGE_NONE) ? 0 : HUGE_PAGE;
+    char *m = mmap(NULL, size + extra, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t head;
 
-  // Shutdown and cleanup
-  //
-  free(h_odata);
-  free(h_idata);
-  clReleaseMemObject(d_odata);
-  clReleaseMemObject(d_idata);
-  clReleaseProgram(program);
-  clReleaseContext(context);
+    if (m == MAP_FAILED)
+      error("Failed to allocate host memory!\n");
+    head = ROUND_UP((uintptr_t)m, page) - (uintptr_t)m;
+    if (head != 0)
+      munmap(m, head);
+    if (extra != head)
+      munmap(m + head + size, extra - head);
+    p = m + head;
+#ifdef MADV_HUGEPAGE
+    if (arena.huge != HUGE_NONE)
+      madvise(p, size, MADV_HUGEPAGE);
+#endif
+  }
 
-  return 0;
+  arena.blocks[arena.nb].p = p;
+  arena.blocks[arena.nb].size = size;
+  arena.blocks[arena.nb].used = 1;
+  arena.nb++;
+  return p;
+}
+
+/* Retour d'un bloc a l'arene, ou il reste projete (rien si p est NULL) */
+static void arena_free(void *p)
+{
+  for(int b = 0; b < arena.nb; b++)
+    if (arena.blocks[b].p == p)
+      arena.blocks[b].used = 0;
+}
+
+/* Blocs libres rendus au systeme */
+static void arena_release(void)
+{
+  for(int b = 0; b < arena.nb; b++)
+    if (!arena.blocks[b].used) {
+      munmap(arena.blocks[b].p, arena.blocks[b].size);
+      arena.blocks[b--] = arena.blocks[--arena.nb];
+    }
+}
+
+/* Threads de calcul du CPU. Le thread principal pilote les devices (il
+ * lance les noyaux et les transferts, attend leurs evenements) : il a son
+ * coeur a lui (--driver-core) et ne calcule pas, les threads de calcul
+ * sont fixes chacun sur un des autres coeurs (--affinity). Les lignes
+ * sont coupees en autant de bandes que de threads, dans l'ordre des
+ * noeuds NUMA : chaque socket calcule une bande continue, dont
+ * alloc_grid() a deja place les pages dans sa memoire. */
+enum { AFFINITY_NONE = STENCIL_AFFINITY_NONE, AFFINITY_COMPACT = STENCIL_AFFINITY_COMPACT,
+       AFFINITY_SPREAD = STENCIL_AFFINITY_SPREAD };
+#ifndef STENCIL_LIBRARY
+static const char *affinity_names[] = { "none", "compact", "spread" };
+#endif
+#define DRIVER_NONE STENCIL_DRIVER_NONE
+#define DRIVER_AUTO STENCIL_DRIVER_AUTO
+
+static struct {
+  int threads;                          // compute threads, 0 for auto
+  int affinity;
+  int driver;                           // core of the driver thread
+  int team;                             // OpenMP team: compute threads + driver
+  int cpu[CPU_SETSIZE];                 // core of each compute thread, -1 if free
+  int rank[CPU_SETSIZE];                // its band of rows, in NUMA node order
+} cpus = { .affinity = AFFINITY_COMPACT, .driver = DRIVER_AUTO };
+
+/* Noeud NUMA d'un coeur, 0 si la machine n'en a qu'un */
+static int cpu_node(int cpu)
+{
+  char path[64];
+  struct dirent *e;
+  DIR *d;
+  int node = 0;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  if ((d = opendir(path)) == NULL)
+    return 0;
+  while ((e = readdir(d)) != NULL)
+    if (sscanf(e->d_name, "node%d", &node) == 1)
+      break;
+  closedir(d);
+  return node;
+}
+
+/* Fixe le thread appelant sur un coeur (rien si cpu < 0). OpenMP garde
+ * ses threads d'une region a l'autre : l'appel systeme n'est fait que la
+ * premiere fois. */
+static void pin_thread(int cpu)
+{
+  static __thread int pinned = -1;
+  cpu_set_t set;
+
+  if (cpu < 0 || cpu == pinned)
+    return;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    error("can not pin a thread on core %d\n", cpu);
+  pinned = cpu;
+}
+
+/* Placement des threads parmi les coeurs permis au processus. Appele
+ * avant la creation du contexte OpenCL : les threads du runtime heritent
+ * du coeur du thread principal. */
+static void cpu_init(void)
+{
+  cpu_set_t allowed;
+  int core[CPU_SETSIZE], node[CPU_SETSIZE], order[CPU_SETSIZE];
+  int thread_node[CPU_SETSIZE];
+  int nb = 0, nb_nodes = 1, k = 0;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    error("can not get the cores of the process\n");
+  if (cpus.driver == DRIVER_AUTO)
+    for(cpus.driver = 0; !CPU_ISSET(cpus.driver, &allowed); cpus.driver++)
+      ;
+  if (cpus.driver >= CPU_SETSIZE || (cpus.driver >= 0 && !CPU_ISSET(cpus.driver, &allowed)))
+    error("core %d is not available for the driver thread\n", cpus.driver);
+  // The driver core is left out, unless it is the only one
+  for(int c = 0; c < CPU_SETSIZE; c++)
+    if (CPU_ISSET(c, &allowed) && (c != cpus.driver || CPU_COUNT(&allowed) == 1)) {
+      core[nb] = c;
+      node[nb] = cpu_node(c);
+      if (node[nb] >= nb_nodes)
+	nb_nodes = node[nb] + 1;
+      nb++;
+    }
+
+  if (cpus.threads == 0)
+    cpus.threads = nb;
+  if (cpus.threads > CPU_SETSIZE)
+    error("--threads expects at most %d threads\n", CPU_SETSIZE);
+  cpus.team = cpus.threads + (cpus.driver >= 0);
+
+  // compact fills a node before the next one, spread deals the cores of
+  // the nodes in turn
+  if (cpus.affinity == AFFINITY_SPREAD) {
+    int used[CPU_SETSIZE] = { 0 };
+
+    for(int n = 0; k < nb; n = (n + 1) % nb_nodes)
+      for(int c = 0; c < nb; c++)
+	if (node[c] == n && !used[c]) {
+	  used[c] = 1;
+	  order[k++] = c;
+	  break;
+	}
+  } else
+    for(int n = 0; n < nb_nodes; n++)
+      for(int c = 0; c < nb; c++)
+	if (node[c] == n)
+	  order[k++] = c;
+
+  // More threads than cores wrap around
+  for(int t = 0; t < cpus.threads; t++) {
+    cpus.cpu[t] = (cpus.affinity == AFFINITY_NONE) ? -1 : core[order[t % nb]];
+    thread_node[t] = (cpus.affinity == AFFINITY_NONE) ? 0 : node[order[t % nb]];
+  }
+  k = 0;
+  for(int n = 0; n < nb_nodes; n++)
+    for(int t = 0; t < cpus.threads; t++)
+      if (thread_node[t] == n)
+	cpus.rank[t] = k++;
+
+  if (cpus.affinity != AFFINITY_NONE)
+    pin_thread(cpus.driver);
+}
+
+/* Dans une region OpenMP de cpus.team threads : fixe le thread appelant
+ * et renvoie son numero de thread de calcul, -1 pour le pilote */
+static int cpu_thread(void)
+{
+  int t = omp_get_thread_num() - (cpus.driver >= 0);
+
+  if (cpus.affinity != AFFINITY_NONE)
+    pin_thread(t < 0 ? cpus.driver : cpus.cpu[t]);
+  return t;
+}
+
+/* Bande du thread de calcul t parmi les lignes [first, last) */
+static void thread_rows(int t, int first, int last, int *lo, int *hi)
+{
+  *lo = first + (int)((long)(last - first) * cpus.rank[t] / cpus.threads);
+  *hi = first + (int)((long)(last - first) * (cpus.rank[t] + 1) / cpus.threads);
+}
+
+static void stencil_cpu(store_t* B, const store_t* A, int first, int last)
+{
+  double t0 = trace_now();
+
+  #pragma omp parallel num_threads(cpus.team)
+  {
+    int t = cpu_thread(), lo, hi;
+
+    if (t >= 0) {
+      thread_rows(t, first, last, &lo, &hi);
+      for(int y=lo; y<hi; y++)
+	cpu_kernel->row(B + y*LINESIZE, A + y*LINESIZE, par.xdim, LINESIZE, 1);
+#ifdef HAVE_X86_SIMD
+      // Non-temporal stores must be visible before the threads join
+      _mm_sfence();
+#endif
+    }
+  }
+  trace_cpu("stencil", t0);
+}
+
+/* Maximum pour la norme de la mise a jour, qui garde NaN (fmax() le
+ * laisse de cote) : une grille qui a diverge ne semble pas convergee */
+static inline double max_nan(double a, double b)
+{
+  return (isnan(b) || b > a) ? b : a;
 }
+#pragma omp declare reduction(max_nan : double : omp_out = max_nan(omp_out, omp_in)) \
+  initializer(omp_priv = 0.0)
+
+/* Recopie d'une ligne calculee b dans la grille a, et sa contribution a
+ * la norme de la mise a jour si norm est vrai */
+static inline void put_row(store_t *a, const store_t *b, int norm, double *rmax, double *rsum)
+{
+  if (norm)
+    for(int x=0; x<par.xdim; x++) {
+      double d = load_point(b[x]) - load_point(a[x]);
 
+      if (par.norm == NORM_L2)
+	*rsum += d*d;
+      else
+	*rmax = max_nan(*rmax, fabs(d));
+    }
+  memcpy(a, b, par.xdim*sizeof(store_t));
+}
+
+/* Iteration sur place (--in-place) des lignes [first, last) de A : une
+ * seule grille au lieu de deux. Une ligne n'est recopiee dans A qu'une
+ * fois la suivante calculee, dernier calcul a lire son ancienne valeur.
+ * Chaque thread n'a que quatre lignes a lui, prises dans rows (celles du
+ * plan, quatre par thread de calcul) : deux qui tournent, et la premiere
+ * et la derniere de sa bande, que ses voisins lisent aussi et qui sont
+ * donc calculees avant une barriere. Chaque point est lu et ecrit une
+ * fois en memoire, comme dans stencil_cpu(), les lignes du thread restent
+ * en cache. Si norm n'est pas NULL il recoit la norme de la mise a jour,
+ * comme de residual_cpu(), calculee au passage. */
+static void stencil_cpu_inplace(store_t *A, store_t *rows, int first, int last, double *norm)
+{
+  double rmax = 0.0, rsum = 0.0;
+  double t0 = trace_now();
+
+  #pragma omp parallel num_threads(cpus.team) reduction(max_nan:rmax) reduction(+:rsum)
+  {
+    int t = cpu_thread(), lo = 0, hi = 0;
+    store_t *edge[2] = { NULL, NULL }, *roll[2] = { NULL, NULL };
+
+    if (t >= 0) {
+      thread_rows(t, first, last, &lo, &hi);
+      edge[0] = rows + 4*t*LINESIZE;
+      edge[1] = edge[0] + LINESIZE;
+      roll[0] = edge[0] + 2*LINESIZE;
+      roll[1] = edge[0] + 3*LINESIZE;
+      if (hi > lo)
+	cpu_kernel->row(edge[0], A + lo*LINESIZE, par.xdim, LINESIZE, 0);
+      if (hi - lo > 1)
+	cpu_kernel->row(edge[1], A + (hi - 1)*LINESIZE, par.xdim, LINESIZE, 0);
+    }
+    #pragma omp barrier
+
+    for(int y = lo + 1; y < hi - 1; y++) {
+      cpu_kernel->row(roll[y%2], A + y*LINESIZE, par.xdim, LINESIZE, 0);
+      put_row(A + (y - 1)*LINESIZE, (y - 1 == lo) ? edge[0] : roll[(y - 1)%2],
+	      norm != NULL, &rmax, &rsum);
+    }
+    for(int y = (hi - lo > 2) ? hi - 2 : lo; y < hi; y++)
+      put_row(A + y*LINESIZE, (y == lo) ? edge[0] : (y == hi - 1) ? edge[1] : roll[y%2],
+	      norm != NULL, &rmax, &rsum);
+  }
+  if (norm != NULL)
+    *norm = (par.norm == NORM_L2) ? rsum : rmax;
+  trace_cpu("stencil in place", t0);
+}
+
+/* Pavage temporel de la partie CPU : nsteps iterations sur les lignes
+ * [0, rows) en un seul passage par la memoire. A[0] contient l'etat de
+ * depart et l'iteration t ecrit dans A[t%2], comme autant d'appels a
+ * stencil_cpu() : chaque point est calcule par le meme noyau a partir des
+ * memes valeurs, le resultat est identique au bit pres.
+ *
+ * Les lignes sont coupees en blocs independants. Chaque bloc avance
+ * d'abord de nsteps iterations en perdant une ligne de chaque cote par
+ * iteration (trapezes), en front d'onde : la ligne y a l'iteration t suit
+ * la ligne y+1 a l'iteration t-1, seules nsteps+2 lignes par tableau sont
+ * utilisees a la fois et restent en cache. Les triangles inverses entre
+ * deux blocs sont completes ensuite. Deux tableaux suffisent : une valeur
+ * n'est ecrasee qu'une fois que plus personne ne la lit.
+ * Chaque thread prend une suite de blocs continue, dans sa bande de
+ * stencil_cpu().
+ * Si shrink est vrai, le bas de la partie est une bande fantome qui perd
+ * elle aussi une ligne par iteration (lignes [0, rows - t + 1) a
+ * l'iteration t), sinon c'est le bord de la grille. */
+static void stencil_cpu_blocked(store_t *A[2], int rows, int shrink, int nsteps)
+{
+  // Plusieurs blocs par thread, chacun au moins deux fois plus haut que
+  // les triangles qui le bordent
+  int height = rows / (4*cpus.threads);
+  if (height < 4*nsteps)
+    height = 4*nsteps;
+  int nb_blocks = rows / height > 0 ? rows / height : 1;
+  double t0 = trace_now();
+
+  #pragma omp parallel num_threads(cpus.team)
+  {
+    int id = cpu_thread(), b_lo = 0, b_hi = 0;
+
+    if (id >= 0)
+      thread_rows(id, 0, nb_blocks, &b_lo, &b_hi);
+    for(int b = b_lo; b < b_hi; b++) {
+      int first = b*height;
+      int last = (b == nb_blocks - 1) ? rows : first + height;
+
+      for(int w = first; w < last + nsteps - 1; w++)
+	for(int t = 1; t <= nsteps; t++) {
+	  int y = w - (t - 1);
+	  int lo = (b == 0) ? 0 : first + t - 1;
+	  int hi = (b == nb_blocks - 1 && !shrink) ? rows : last - t + 1;
+	  if (y >= lo && y < hi)
+	    cpu_kernel->row(A[t%2] + y*LINESIZE, A[(t-1)%2] + y*LINESIZE,
+			    par.xdim, LINESIZE, 0);
+	}
+    }
+
+    #pragma omp barrier
+    for(int b = (b_lo > 0 ? b_lo : 1); b < b_hi; b++) {
+      int edge = b*height;
+
+      for(int t = 2; t <= nsteps; t++)
+	for(int y = edge - t + 1; y < edge + t - 1; y++)
+	  cpu_kernel->row(A[t%2] + y*LINESIZE, A[(t-1)%2] + y*LINESIZE,
+			  par.xdim, LINESIZE, 0);
+    }
+  }
+  trace_cpu("stencil blocked", t0);
+}
+
+#ifndef STENCIL_LIBRARY
+/* Partie CPU d'un lot de grilles (--batch) : nsteps iterations sur les
+ * grilles [0, nb) de A[0], rangees l'une apres l'autre (TOTALSIZE points
+ * chacune). L'iteration t ecrit dans A[t%2], comme pour
+ * stencil_cpu_blocked(). Avec au moins une grille par thread, chaque
+ * thread prend une suite de grilles et fait toutes leurs iterations sans
+ * attendre les autres : une petite grille reste dans son cache. Sinon les
+ * lignes de toutes les grilles sont coupees en bandes comme dans
+ * stencil_cpu(), avec une barriere par iteration. */
+static void stencil_cpu_batch(store_t *A[2], int nb, int nsteps)
+{
+  size_t grid = TOTALSIZE;
+  double t0 = trace_now();
+
+  #pragma omp parallel num_threads(cpus.team)
+  {
+    int t = cpu_thread(), lo = 0, hi = 0;
+
+    if (nb >= cpus.threads) {
+      if (t >= 0)
+	thread_rows(t, 0, nb, &lo, &hi);
+      for(int g = lo; g < hi; g++)
+	for(int i = 0; i < nsteps; i++)
+	  for(int y = 0; y < par.ydim; y++)
+	    cpu_kernel->row(A[(i + 1)%2] + g*grid + OFFSET + y*LINESIZE,
+			    A[i%2] + g*grid + OFFSET + y*LINESIZE, par.xdim, LINESIZE, 0);
+    } else {
+      if (t >= 0)
+	thread_rows(t, 0, nb*par.ydim, &lo, &hi);
+      for(int i = 0; i < nsteps; i++) {
+	for(int r = lo; r < hi; r++) {
+	  size_t p = (r / par.ydim)*grid + OFFSET + (r % par.ydim)*LINESIZE;
+
+	  cpu_kernel->row(A[(i + 1)%2] + p, A[i%2] + p, par.xdim, LINESIZE, 1);
+	}
+#ifdef HAVE_X86_SIMD
+	_mm_sfence();
+#endif
+	#pragma omp barrier
+      }
+    }
+  }
+  trace_cpu("stencil batch", t0);
+}
+#endif
+
+/* Norme de la mise a jour B - A sur les lignes [first, last) de la
+ * partie CPU, reduite entre les threads : max |B - A|, ou la somme des
+ * carres pour NORM_L2 */
+static double residual_cpu(const store_t *B, const store_t *A, int first, int last)
+{
+  double rmax = 0.0, rsum = 0.0;
+  double t0 = trace_now();
+
+  #pragma omp parallel num_threads(cpus.team) reduction(max_nan:rmax) reduction(+:rsum)
+  {
+    int t = cpu_thread(), lo, hi;
+
+    if (t >= 0) {
+      thread_rows(t, first, last, &lo, &hi);
+      for(int y=lo; y<hi; y++)
+	for(int x=0; x<par.xdim; x++) {
+	  double d = load_point(B[y*LINESIZE + x]) - load_point(A[y*LINESIZE + x]);
+
+	  if (par.norm == NORM_L2)
+	    rsum += d*d;
+	  else
+	    rmax = max_nan(rmax, fabs(d));
+	}
+    }
+  }
+  trace_cpu("residual", t0);
+  return (par.norm == NORM_L2) ? rsum : rmax;
+}
+
+/* Transferts des lignes [first, last) de la grille entre l'hote et le
+ * device. Le buffer du device commence a la ligne gpu_base - 1 de la
+ * grille (bord ou ligne fantome du CPU). */
+static void write_rows(cl_command_queue queue, cl_mem d, const store_t *h,
+		       int gpu_base, int first, int last)
+{
+  cl_event local;
+  cl_int err;
+
+  err = clEnqueueWriteBuffer(queue, d, CL_TRUE,
+			     sizeof(store_t)*LINESIZE*(first + 1 - gpu_base),
+			     sizeof(store_t)*LINESIZE*(last - first),
+			     h + LINESIZE*(first + 1), 0, NULL, trace_event(NULL, &local));
+  check(err, "Failed to write matrix!\n");
+  trace_command(queue, PHASE_H2D, "write rows", NULL, local);
+}
+
+static void read_rows(cl_command_queue queue, cl_mem d, store_t *h,
+		      int gpu_base, int first, int last)
+{
+  cl_event local;
+  cl_int err;
+
+  err = clEnqueueReadBuffer(queue, d, CL_TRUE,
+			    sizeof(store_t)*LINESIZE*(first + 1 - gpu_base),
+			    sizeof(store_t)*LINESIZE*(last - first),
+			    h + LINESIZE*(first + 1), 0, NULL, trace_event(NULL, &local));
+  check(err, "Failed to read matrix! %d\n", err);
+  trace_command(queue, PHASE_D2H, "read rows", NULL, local);
+}
+
+#ifndef STENCIL_LIBRARY
+/* Versions non bloquantes, chainees par evenements */
+static void write_rows_async(cl_command_queue queue, cl_mem d, const store_t *h,
+			     int gpu_base, int first, int last,
+			     cl_uint nb_wait, const cl_event *wait, cl_event *event)
+{
+  cl_event local;
+  cl_int err;
+
+  err = clEnqueueWriteBuffer(queue, d, CL_FALSE,
+			     sizeof(store_t)*LINESIZE*(first + 1 - gpu_base),
+			     sizeof(store_t)*LINESIZE*(last - first),
+			     h + LINESIZE*(first + 1), nb_wait, wait, trace_event(event, &local));
+  check(err, "Failed to write matrix!\n");
+  trace_command(queue, PHASE_H2D, "write halo", event, local);
+}
+
+static void read_rows_async(cl_command_queue queue, cl_mem d, store_t *h,
+			    int gpu_base, int first, int last,
+			    cl_uint nb_wait, const cl_event *wait, cl_event *event)
+{
+  cl_event local;
+  cl_int err;
+
+  err = clEnqueueReadBuffer(queue, d, CL_FALSE,
+			    sizeof(store_t)*LINESIZE*(first + 1 - gpu_base),
+			    sizeof(store_t)*LINESIZE*(last - first),
+			    h + LINESIZE*(first + 1), nb_wait, wait, trace_event(event, &local));
+  check(err, "Failed to read matrix! %d\n", err);
+  trace_command(queue, PHASE_D2H, "read halo", event, local);
+}
+#endif
+
+/* Transferts du rectangle [x0, x1) x [first, last) de la grille : seuls
+ * ses points passent, sans le reste des lignes ni le padding */
+static void rect_origins(size_t *buffer, size_t *host, size_t *region,
+			 int gpu_base, int x0, int x1, int first, int last)
+{
+  buffer[0] = host[0] = sizeof(store_t)*(16 + x0);
+  buffer[1] = first + 1 - gpu_base;
+  host[1] = first + 1;
+  buffer[2] = host[2] = 0;
+  region[0] = sizeof(store_t)*(x1 - x0);
+  region[1] = last - first;
+  region[2] = 1;
+}
+
+static void read_rect(cl_command_queue queue, cl_mem d, store_t *h,
+		      int gpu_base, int x0, int x1, int first, int last)
+{
+  size_t buffer[3], host[3], region[3];
+  cl_event local;
+  cl_int err;
+
+  rect_origins(buffer, host, region, gpu_base, x0, x1, first, last);
+  err = clEnqueueReadBufferRect(queue, d, CL_TRUE, buffer, host, region,
+				sizeof(store_t)*LINESIZE, 0, sizeof(store_t)*LINESIZE, 0,
+				h, 0, NULL, trace_event(NULL, &local));
+  check(err, "Failed to read matrix! %d\n", err);
+  trace_command(queue, PHASE_D2H, "read rows", NULL, local);
+}
+
+static void write_rect_async(cl_command_queue queue, cl_mem d, const store_t *h,
+			     int gpu_base, int x0, int x1, int first, int last,
+			     cl_uint nb_wait, const cl_event *wait, cl_event *event)
+{
+  size_t buffer[3], host[3], region[3];
+  cl_event local;
+  cl_int err;
+
+  rect_origins(buffer, host, region, gpu_base, x0, x1, first, last);
+  err = clEnqueueWriteBufferRect(queue, d, CL_FALSE, buffer, host, region,
+				 sizeof(store_t)*LINESIZE, 0, sizeof(store_t)*LINESIZE, 0,
+				 h, nb_wait, wait, trace_event(event, &local));
+  check(err, "Failed to write matrix!\n");
+  trace_command(queue, PHASE_H2D, "write halo", event, local);
+}
+
+static void read_rect_async(cl_command_queue queue, cl_mem d, store_t *h,
+			    int gpu_base, int x0, int x1, int first, int last,
+			    cl_uint nb_wait, const cl_event *wait, cl_event *event)
+{
+  size_t buffer[3], host[3], region[3];
+  cl_event local;
+  cl_int err;
+
+  rect_origins(buffer, host, region, gpu_base, x0, x1, first, last);
+  err = clEnqueueReadBufferRect(queue, d, CL_FALSE, buffer, host, region,
+				sizeof(store_t)*LINESIZE, 0, sizeof(store_t)*LINESIZE, 0,
+				h, nb_wait, wait, trace_event(event, &local));
+  check(err, "Failed to read matrix! %d\n", err);
+  trace_command(queue, PHASE_D2H, "read halo", event, local);
+}
+
+/* Variantes du noyau OpenCL (stencil.cl), choisies par leur nom. Par
+ * defaut elles calculent 4 lignes par work-item, les work-groups font 16
+ * lignes ; la forme des work-groups et le nombre de lignes des variantes
+ * reglables sont choisis par --autotune pour chaque device. Un
+ * work-group couvre toujours un diviseur de SPLIT_STEP lignes. Les
+ * variantes fusionnees font un bloc de --time-block iterations par
+ * lancement (voir launch_rect_fused()). */
+struct gpu_kernel {
+  const char *name;
+  const char *entry;                    // kernel function in stencil.cl
+  int width;                            // points per work-item along x
+  size_t local[2];                      // work group size
+  int rows;                             // rows per work-item
+  int fused;                            // several iterations per launch
+  int tunable;                          // free work group size and rows
+};
+
+static const struct gpu_kernel gpu_kernels[] = {
+  { "naive", "stencil", 1, { 16, 4 }, 4, 0, 1 },
+  { "tiled", "stencil_tiled", 1, { 16, 4 }, 4, 0, 0 },
+  { "float4", "stencil_float4", 4, { 4, 4 }, 4, 0, 1 },
+  { "fused", "stencil_fused", 4, { 16, 4 }, 4, 1, 0 },
+};
+#define NB_GPU_KERNELS (sizeof(gpu_kernels)/sizeof(gpu_kernels[0]))
+
+/* Variante demandee par --gpu-kernel, NULL (auto) pour celle reglee pour
+ * chaque device, ou naive */
+static const struct gpu_kernel *gpu_kernel = NULL;
+
+#define GPU_KERNEL_NAME ( gpu_kernel != NULL ? gpu_kernel->name : "auto" )
+
+static void select_gpu_kernel(const char *name)
+{
+  if (name == NULL || !strcmp(name, "auto")) {
+    gpu_kernel = NULL;
+    return;
+  }
+  for(unsigned int k = 0; k < NB_GPU_KERNELS; k++)
+    if (!strcmp(name, gpu_kernels[k].name)) {
+      gpu_kernel = &gpu_kernels[k];
+      return;
+    }
+  error("unknown GPU kernel \"%s\"\n", name);
+}
+
+/* Transferts d'un echange de halo, de chaque cote d'une tranche : ses
+ * bords lus vers l'hote (READ_*), ceux de ses voisines ecrits depuis
+ * l'hote (WRITE_*) */
+enum { READ_TOP, READ_BOTTOM, WRITE_TOP, WRITE_BOTTOM,
+       READ_LEFT, READ_RIGHT, WRITE_LEFT, WRITE_RIGHT, NB_SIDES };
+#define HALO_READ(side) ( (side) % 4 < 2 )
+
+/* Tranche de la grille calculee par un device OpenCL. Les tranches sont
+ * empilees sous la partie CPU, dans l'ordre des devices ; avec
+ * --device-columns C chaque bande de C tranches se partage aussi les
+ * colonnes, de gauche a droite. Chacune echange ses bords avec ses
+ * voisines (CPU ou device) a travers les grilles de l'hote. Les buffers
+ * du device couvrent les lignes [base - 1, end] sur toute leur largeur :
+ * la tranche, ses lignes fantomes et les lignes qui les bordent. */
+struct slab {
+  cl_device_id device;
+  cl_command_queue queue;
+  cl_command_queue xfer_queue;          // halo exchanges, beside the kernels
+  cl_kernel kernel;
+  struct gpu_kernel gk;                 // variant and launch geometry
+  cl_mem d_idata, d_odata;
+  int base;                             // first grid line held by the buffers
+  int end;                              // last row held by the buffers
+  int first, last;                      // rows owned by the device
+  int left, right;                      // columns owned by the device
+  int zero_copy;                        // buffers are the host grids
+  cl_event halo[NB_SIDES];              // exchange in flight, indexed as below
+  cl_event next_halo[NB_SIDES];         // exchange started by this block
+  cl_event edge_event;                  // last edge launch of an exchange step
+  cl_event timed[2];                    // other launches timed for --balance
+  int nb_timed;
+  int work;                             // rows computed by the timed launches
+  cl_kernel residual_kernel, reduce_kernel;     // convergence checks
+  cl_mem d_residual;                    // one value per work group
+  real_t residual;                      // norm of the slab's update
+  cl_event residual_event;
+};
+
+/* Calcul du rectangle [x0, x1) x [first, last) de la grille sur le
+ * device. La hauteur doit etre un multiple de SPLIT_STEP, x0 et x1 des
+ * multiples de COL_STEP ou les bords de la grille. */
+static void launch_rect(const struct slab *s, cl_mem d_out, cl_mem d_in, int x0, int x1,
+			int first, int last,
+			cl_uint nb_wait, const cl_event *wait, cl_event *event)
+{
+  size_t global[2] = { (x1 - x0) / s->gk.width, (last - first)/s->gk.rows };
+  size_t offset[2] = { x0 / s->gk.width, (first - s->base)/s->gk.rows };
+  unsigned int line_size = LINESIZE;
+  unsigned int rows = s->gk.rows;
+  cl_event traced;
+  cl_int err = 0;
+
+  err |= clSetKernelArg(s->kernel, 0, sizeof(cl_mem), &d_out);
+  err |= clSetKernelArg(s->kernel, 1, sizeof(cl_mem), &d_in);
+  err |= clSetKernelArg(s->kernel, 2, sizeof(unsigned int), &line_size);
+  if (s->gk.tunable)
+    err |= clSetKernelArg(s->kernel, 3, sizeof(unsigned int), &rows);
+  check(err, "Failed to set kernel arguments! %d\n", err);
+
+  err = clEnqueueNDRangeKernel(s->queue, s->kernel, 2, offset, global, s->gk.local,
+			       nb_wait, wait, trace_event(event, &traced));
+  check(err, "Failed to execute kernel!\n");
+  trace_command(s->queue, PHASE_KERNEL, s->gk.name, event, traced);
+}
+
+#ifndef STENCIL_LIBRARY
+/* Calcul des lignes [first, last), sur toute la largeur */
+static void launch_rows(const struct slab *s, cl_mem d_out, cl_mem d_in, int first, int last,
+			cl_uint nb_wait, const cl_event *wait, cl_event *event)
+{
+  launch_rect(s, d_out, d_in, 0, par.xdim, first, last, nb_wait, wait, event);
+}
+#endif
+
+/* Lancement fusionne : nsteps iterations sur le rectangle [x0, x1) x
+ * [first, last) (celui de la derniere iteration). d_out doit etre
+ * distinct de d_in. La derniere ligne des buffers est le bord du noyau. */
+static void launch_rect_fused(const struct slab *s, cl_mem d_out, cl_mem d_in, int x0, int x1,
+			      int first, int last, int nsteps,
+			      cl_uint nb_wait, const cl_event *wait, cl_event *event)
+{
+  unsigned int steps = nsteps;
+  unsigned int ydim = s->end - s->base;
+  cl_int err = 0;
+
+  err |= clSetKernelArg(s->kernel, 3, sizeof(unsigned int), &steps);
+  err |= clSetKernelArg(s->kernel, 4, sizeof(unsigned int), &ydim);
+  check(err, "Failed to set kernel arguments! %d\n", err);
+
+  launch_rect(s, d_out, d_in, x0, x1, first, last, nb_wait, wait, event);
+}
+
+/* Le noyau fusionne garde deux tuiles et leur halo en memoire locale :
+ * verification de la place sur le device */
+static int fused_fits(cl_device_id device, const struct gpu_kernel *k)
+{
+  cl_ulong local_mem;
+  size_t tiles = 2*(16 + 2*par.time_block)*(64 + 2*par.time_block)*sizeof(real_t);
+  cl_int err;
+
+  if (!k->fused)
+    return 1;
+  err = clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE,
+			sizeof(local_mem), &local_mem, NULL);
+  check(err, "Cannot get local memory size of device");
+  return tiles <= local_mem;
+}
+
+/* Une variante ne s'applique qu'aux grilles dont la largeur est un
+ * multiple de ses work-groups, et dont les colonnes des devices en
+ * sont aussi. En place (--zero-copy) les lancements partent des lignes
+ * de la grille : sa hauteur doit etre un multiple des lignes d'un
+ * work-item. */
+static int kernel_fits(const struct gpu_kernel *k)
+{
+  return par.xdim % k->width == 0 && par.xdim / k->width % k->local[0] == 0 &&
+    (par.device_columns == 1 || COL_STEP % (k->width * k->local[0]) == 0) &&
+    (!par.zero_copy || par.ydim % k->rows == 0);
+}
+
+static void check_kernel(const struct slab *s)
+{
+  if (!kernel_fits(&s->gk))
+    error("the %s GPU kernel needs a grid width multiple of %d%s\n",
+	  s->gk.name, (int)(s->gk.width * s->gk.local[0]),
+	  par.device_columns > 1 ? " dividing the device columns" : "");
+  if (!fused_fits(s->device, &s->gk))
+    error("--time-block %d needs more local memory than the device has\n", par.time_block);
+}
+
+/* Lignes calculees par une tranche quand il reste ghost lignes fantomes
+ * a calculer du cote de chaque voisine, arrondies aux work-groups vers
+ * l'exterieur de la tranche */
+static int slab_lo(const struct slab *s, int ghost)
+{
+  return (s->first == 0) ? 0 : s->first - ROUND_UP(ghost, SPLIT_STEP);
+}
+
+static int slab_hi(const struct slab *s, int ghost)
+{
+  return (s->last == par.ydim) ? par.ydim : s->last + ROUND_UP(ghost, SPLIT_STEP);
+}
+
+/* De meme pour les colonnes fantomes, arrondies a COL_STEP */
+static int col_lo(const struct slab *s, int ghost)
+{
+  return (s->left == 0) ? 0 : s->left - ROUND_UP(ghost, COL_STEP);
+}
+
+static int col_hi(const struct slab *s, int ghost)
+{
+  return (s->right == par.xdim) ? par.xdim : s->right + ROUND_UP(ghost, COL_STEP);
+}
+
+/* Rectangle [x0, x1) x [y0, y1) de la grille */
+struct rect {
+  int x0, x1, y0, y1;
+};
+
+static int rect_meets(struct rect a, struct rect b)
+{
+  return a.x0 < b.x1 && b.x0 < a.x1 && a.y0 < b.y1 && b.y0 < a.y1;
+}
+
+/* La tranche a-t-elle une voisine (CPU ou device) du cote side ? */
+static int halo_side(const struct slab *s, int side)
+{
+  switch (side) {
+  case READ_TOP: case WRITE_TOP: return s->first > 0;
+  case READ_BOTTOM: case WRITE_BOTTOM: return s->last < par.ydim;
+  case READ_LEFT: case WRITE_LEFT: return s->left > 0;
+  default: return s->right < par.xdim;
+  }
+}
+
+/* Points transferes d'un cote d'une tranche par un echange : les halo
+ * premieres lignes ou colonnes de la tranche pour READ_*, les halo qui
+ * la bordent pour WRITE_*. Les bandes du haut et du bas portent les
+ * coins, que les voisines en diagonale lisent dans leurs propres
+ * bandes. */
+static struct rect halo_rect(const struct slab *s, int side)
+{
+  struct rect r = { s->left, s->right, s->first, s->last };
+
+  switch (side) {
+  case READ_TOP: r.y1 = s->first + par.halo; break;
+  case READ_BOTTOM: r.y0 = s->last - par.halo; break;
+  case READ_LEFT: r.x1 = s->left + par.halo; break;
+  case READ_RIGHT: r.x0 = s->right - par.halo; break;
+  case WRITE_TOP: r.y0 = s->first - par.halo; r.y1 = s->first; break;
+  case WRITE_BOTTOM: r.y0 = s->last; r.y1 = s->last + par.halo; break;
+  case WRITE_LEFT: r.x0 = s->left - par.halo; r.x1 = s->left; break;
+  case WRITE_RIGHT: r.x0 = s->right; r.x1 = s->right + par.halo; break;
+  }
+  if (side == WRITE_TOP || side == WRITE_BOTTOM) {
+    r.x0 = (s->left < par.halo) ? 0 : s->left - par.halo;
+    r.x1 = (s->right + par.halo > par.xdim) ? par.xdim : s->right + par.halo;
+  }
+  if (r.y0 < 0)
+    r.y0 = 0;
+  if (r.y1 > par.ydim)
+    r.y1 = par.ydim;
+  if (r.x0 < 0)
+    r.x0 = 0;
+  if (r.x1 > par.xdim)
+    r.x1 = par.xdim;
+  return r;
+}
+
+/* Evenements que le premier calcul d'une tranche attend apres un echange :
+ * ses propres transferts, et ceux de ses voisines qui envoient depuis
+ * l'hote les points qu'elle va y relire */
+static cl_uint slab_incoming(const struct slab *slabs, int nb_slabs, int n, cl_event *wait)
+{
+  struct rect own = { slabs[n].left, slabs[n].right, slabs[n].first, slabs[n].last };
+  cl_uint nb_wait = 0;
+
+  for(int h = 0; h < NB_SIDES; h++)
+    if (slabs[n].halo[h] != NULL)
+      wait[nb_wait++] = slabs[n].halo[h];
+  for(int m = 0; m < nb_slabs; m++)
+    for(int h = 0; h < NB_SIDES; h++)
+      if (m != n && !HALO_READ(h) && slabs[m].halo[h] != NULL &&
+	  rect_meets(halo_rect(&slabs[m], h), own))
+	wait[nb_wait++] = slabs[m].halo[h];
+  return nb_wait;
+}
+
+/* Evenement d'un lancement chronometre pour --balance */
+static cl_event *timed_event(struct slab *s)
+{
+  return par.balance ? &s->timed[s->nb_timed++] : NULL;
+}
+
+/* Iterations [i0, i0 + nsteps) sur une tranche. Sur une iteration d'echange
+ * les bords sont calcules d'abord, pour que leur transfert recouvre le
+ * calcul de l'interieur ; sur celle qui suit seuls les bords attendent le
+ * halo. s->edge_event marque la fin des bords de l'echange. Avec check la
+ * derniere iteration laisse son entree dans l'autre buffer, pour la
+ * verification de la convergence. */
+static void enqueue_slab(struct slab *s, int i0, int nsteps, int exchange, int check,
+			 cl_uint nb_incoming, const cl_event *incoming)
+{
+  int i = i0 + nsteps - 1;
+  int lo = 0, hi = 0, xlo, xhi;
+
+  s->nb_timed = 0;
+  s->work = 0;
+  if (s->gk.fused) {
+    // The fused kernel can not write the buffer it reads: a first launch
+    // of an odd number of iterations, then single ones if needed, end up
+    // in the same buffer as the other kernels
+    int steps = (nsteps % 2 == 1) ? nsteps : nsteps - 1;
+    if (check && steps == nsteps && nsteps > 1)
+      steps = nsteps - 2;
+    cl_mem d_in = (i0 % 2 == 0) ? s->d_idata : s->d_odata;
+    cl_mem d_out = (i0 % 2 == 0) ? s->d_odata : s->d_idata;
+
+    lo = slab_lo(s, par.halo - 1 - (i0 + steps - 1) % par.halo);
+    hi = slab_hi(s, par.halo - 1 - (i0 + steps - 1) % par.halo);
+    xlo = col_lo(s, par.halo - 1 - (i0 + steps - 1) % par.halo);
+    xhi = col_hi(s, par.halo - 1 - (i0 + steps - 1) % par.halo);
+    launch_rect_fused(s, d_out, d_in, xlo, xhi, lo, hi, steps, nb_incoming, incoming,
+		      !exchange ? NULL : (steps == nsteps) ? &s->edge_event : timed_event(s));
+    s->work = steps*(hi - lo);
+    for(int j = i0 + steps; j <= i; j++) {
+      lo = slab_lo(s, par.halo - 1 - j % par.halo);
+      hi = slab_hi(s, par.halo - 1 - j % par.halo);
+      xlo = col_lo(s, par.halo - 1 - j % par.halo);
+      xhi = col_hi(s, par.halo - 1 - j % par.halo);
+      launch_rect_fused(s, (j % 2 == 0) ? s->d_odata : s->d_idata,
+			(j % 2 == 0) ? s->d_idata : s->d_odata, xlo, xhi, lo, hi, 1, 0, NULL,
+			!exchange ? NULL : (j == i) ? &s->edge_event : timed_event(s));
+      s->work += hi - lo;
+    }
+    return;
+  }
+
+  for(int j = i0; j <= i; j++) {
+    cl_mem d_in = (j % 2 == 0) ? s->d_idata : s->d_odata;
+    cl_mem d_out = (j % 2 == 0) ? s->d_odata : s->d_idata;
+    cl_uint nb_wait = (j == i0) ? nb_incoming : 0;
+    const cl_event *wait = (j == i0) ? incoming : NULL;
+    int edge = (exchange && j == i) ? ROUND_UP(par.halo, SPLIT_STEP) : SPLIT_STEP;
+    int xedge = (exchange && j == i) ? ROUND_UP(par.halo, COL_STEP) : COL_STEP;
+    int top, bottom, left, right;	// interior of the slab, between its edges
+
+    lo = slab_lo(s, par.halo - 1 - j % par.halo);
+    hi = slab_hi(s, par.halo - 1 - j % par.halo);
+    xlo = col_lo(s, par.halo - 1 - j % par.halo);
+    xhi = col_hi(s, par.halo - 1 - j % par.halo);
+    top = (s->first == 0) ? lo : s->first + edge;
+    bottom = (s->last == par.ydim) ? hi : s->last - edge;
+    left = (s->left == 0) ? xlo : s->left + xedge;
+    right = (s->right == par.xdim) ? xhi : s->right - xedge;
+
+    if (top >= bottom || left >= right || (!(exchange && j == i) && nb_wait == 0)) {
+      launch_rect(s, d_out, d_in, xlo, xhi, lo, hi, nb_wait, wait,
+		  (exchange && j == i) ? &s->edge_event : NULL);
+    } else {
+      // The edges: the top and bottom bands, then the sides between them
+      struct rect edges[4] = { { xlo, xhi, lo, top }, { xlo, xhi, bottom, hi },
+			       { xlo, left, top, bottom }, { right, xhi, top, bottom } };
+      int last_edge = 0;
+
+      for(int e = 0; e < 4; e++)
+	if (edges[e].x0 != edges[e].x1 && edges[e].y0 != edges[e].y1)
+	  last_edge = e;
+      if (!(exchange && j == i))
+	launch_rect(s, d_out, d_in, left, right, top, bottom, 0, NULL, NULL);
+      for(int e = 0; e < 4; e++)
+	if (edges[e].x0 != edges[e].x1 && edges[e].y0 != edges[e].y1)
+	  launch_rect(s, d_out, d_in, edges[e].x0, edges[e].x1, edges[e].y0, edges[e].y1,
+		      nb_wait, wait, !(exchange && j == i) ? NULL :
+		      (e == last_edge) ? &s->edge_event : timed_event(s));
+      if (exchange && j == i)
+	launch_rect(s, d_out, d_in, left, right, top, bottom, 0, NULL, timed_event(s));
+    }
+  }
+  s->work = hi - lo;
+}
+
+/* Lecture vers l'hote, une fois les bords calcules, d'un bord de la
+ * tranche (READ_TOP, READ_BOTTOM, READ_LEFT ou READ_RIGHT) apres
+ * l'iteration i */
+static void read_halo(struct slab *s, int side, store_t *h_last, int i)
+{
+  cl_mem d_last = (i % 2 == 0) ? s->d_odata : s->d_idata;
+  struct rect r = halo_rect(s, side);
+
+  // The points are already in the host grid
+  if (s->zero_copy) {
+    s->next_halo[side] = s->edge_event;
+    clRetainEvent(s->edge_event);
+    return;
+  }
+  read_rect_async(s->xfer_queue, d_last, h_last, s->base, r.x0, r.x1, r.y0, r.y1,
+		  1, &s->edge_event, &s->next_halo[side]);
+}
+
+/* Envoi vers une tranche, apres les evenements wait, des points de
+ * h_last qui la bordent du cote side (WRITE_*) apres l'iteration i.
+ * Quand la tranche partage les grilles de l'hote il n'y a rien a
+ * copier : l'evenement seul passe la main. */
+static void send_halo(struct slab *s, int side, const store_t *h_last, int i,
+		      cl_uint nb_wait, const cl_event *wait)
+{
+  cl_mem d_last = (i % 2 == 0) ? s->d_odata : s->d_idata;
+  struct rect r = halo_rect(s, side);
+  cl_int err;
+
+  if (s->zero_copy) {
+    err = clEnqueueWaitForEvents(s->xfer_queue, nb_wait, wait);
+    err |= clEnqueueMarker(s->xfer_queue, &s->next_halo[side]);
+    check(err, "Failed to enqueue marker!\n");
+  } else
+    write_rect_async(s->xfer_queue, d_last, h_last, s->base, r.x0, r.x1, r.y0, r.y1,
+		     nb_wait, wait, &s->next_halo[side]);
+}
+
+/* Echange de halo entre les devices apres l'iteration i : chaque
+ * tranche lit ses bords vers h_last, puis recoit ce qui la borde des
+ * qu'il y est, c'est-a-dire apres les lectures de ses voisines qui
+ * couvrent ces points. Les bords places dans les lignes [0, busy) de
+ * l'hote, que le CPU ecrit encore, et les envois qui en dependent
+ * attendent un appel suivant : ceux deja partis ne sont pas refaits.
+ * Les lignes du CPU (au-dessus de cpu_rows) lui sont envoyees par
+ * le CPU lui-meme. */
+static void exchange_halos(struct slab *slabs, int nb_slabs, store_t *h_last, int i,
+			   int busy, int cpu_rows)
+{
+  for(int n = 0; n < nb_slabs; n++)
+    for(int h = 0; h < NB_SIDES; h++)
+      if (HALO_READ(h) && halo_side(&slabs[n], h) && slabs[n].next_halo[h] == NULL &&
+	  halo_rect(&slabs[n], h).y0 >= busy)
+	read_halo(&slabs[n], h, h_last, i);
+
+  for(int n = 0; n < nb_slabs; n++)
+    for(int h = 0; h < NB_SIDES; h++) {
+      struct slab *s = &slabs[n];
+      struct rect r = halo_rect(s, h);
+      cl_event wait[1 + NB_SIDES*MAX_DEVICES];
+      cl_uint nb_wait = 0;
+      int ready = 1;
+
+      if (HALO_READ(h) || !halo_side(s, h) || s->next_halo[h] != NULL || r.y1 <= cpu_rows)
+	continue;
+      wait[nb_wait++] = s->edge_event;
+      for(int m = 0; m < nb_slabs; m++)
+	for(int g = 0; g < NB_SIDES; g++)
+	  if (m != n && HALO_READ(g) && halo_side(&slabs[m], g) &&
+	      rect_meets(halo_rect(&slabs[m], g), r)) {
+	    if (slabs[m].next_halo[g] == NULL)
+	      ready = 0;
+	    else
+	      wait[nb_wait++] = slabs[m].next_halo[g];
+	  }
+      if (ready)
+	send_halo(s, h, h_last, i, nb_wait, wait);
+    }
+}
+
+/* Verification de la convergence sur une tranche : norme de la mise a
+ * jour d_out - d_in sur ses points, reduite sur le device en deux
+ * lancements (voir residual() dans stencil.cl). Seule la valeur finale
+ * est relue, dans s->residual, a l'evenement s->residual_event. */
+#define RESIDUAL_GROUP  64                // as in stencil.cl
+#define RESIDUAL_GROUPS 64
+
+static void enqueue_residual(struct slab *s, cl_mem d_out, cl_mem d_in)
+{
+  size_t global = RESIDUAL_GROUP*RESIDUAL_GROUPS, local = RESIDUAL_GROUP;
+  unsigned int line_size = LINESIZE, left = s->left, columns = s->right - s->left;
+  unsigned int first = s->first - s->base, rows = s->last - s->first;
+  unsigned int l2 = (par.norm == NORM_L2), n = RESIDUAL_GROUPS;
+  cl_event traced;
+  cl_int err = 0;
+
+  err |= clSetKernelArg(s->residual_kernel, 0, sizeof(cl_mem), &d_out);
+  err |= clSetKernelArg(s->residual_kernel, 1, sizeof(cl_mem), &d_in);
+  err |= clSetKernelArg(s->residual_kernel, 2, sizeof(unsigned int), &line_size);
+  err |= clSetKernelArg(s->residual_kernel, 3, sizeof(unsigned int), &left);
+  err |= clSetKernelArg(s->residual_kernel, 4, sizeof(unsigned int), &columns);
+  err |= clSetKernelArg(s->residual_kernel, 5, sizeof(unsigned int), &first);
+  err |= clSetKernelArg(s->residual_kernel, 6, sizeof(unsigned int), &rows);
+  err |= clSetKernelArg(s->residual_kernel, 7, sizeof(unsigned int), &l2);
+  err |= clSetKernelArg(s->residual_kernel, 8, sizeof(cl_mem), &s->d_residual);
+  check(err, "Failed to set kernel arguments! %d\n", err);
+  err = clEnqueueNDRangeKernel(s->queue, s->residual_kernel, 1, NULL, &global, &local,
+			       0, NULL, trace_event(NULL, &traced));
+  check(err, "Failed to execute kernel!\n");
+  trace_command(s->queue, PHASE_KERNEL, "residual", NULL, traced);
+
+  err = clSetKernelArg(s->reduce_kernel, 0, sizeof(cl_mem), &s->d_residual);
+  err |= clSetKernelArg(s->reduce_kernel, 1, sizeof(unsigned int), &n);
+  err |= clSetKernelArg(s->reduce_kernel, 2, sizeof(unsigned int), &l2);
+  check(err, "Failed to set kernel arguments! %d\n", err);
+  err = clEnqueueNDRangeKernel(s->queue, s->reduce_kernel, 1, NULL, &local, &local,
+			       0, NULL, trace_event(NULL, &traced));
+  check(err, "Failed to execute kernel!\n");
+  trace_command(s->queue, PHASE_KERNEL, "residual_reduce", NULL, traced);
+
+  err = clEnqueueReadBuffer(s->queue, s->d_residual, CL_FALSE, 0, sizeof(real_t),
+			    &s->residual, 0, NULL, &s->residual_event);
+  check(err, "Failed to read the residual!\n");
+}
+
+/* Duree d'une commande, en ms */
+static double event_time(cl_event event)
+{
+  cl_ulong start, end;
+  cl_int err;
+
+  err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+				sizeof(start), &start, NULL);
+  err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+				 sizeof(end), &end, NULL);
+  check(err, "Failed to get profiling info!\n");
+  return (end - start) * 1e-6;
+}
+
+/* Repartition de total lignes (ou colonnes) entre nb devices au prorata
+ * de leurs debits, par paquets de step, chacun en gardant au moins
+ * min_rows. total doit valoir au moins nb*min_rows. */
+static void split_rows(int total, int nb, const double *rate, int *rows, int min_rows, int step)
+{
+  double sum = 0.0;
+  int left = total;
+
+  for(int p = 0; p < nb; p++)
+    sum += rate[p];
+  for(int p = 0; p < nb; p++) {
+    int r = left;
+    int room = left - (nb - 1 - p)*min_rows;   // keep enough for the next ones
+
+    if (p != nb - 1)
+      r = (int)(total * rate[p] / sum + step/2) / step * step;
+    if (r > room)
+      r = room;
+    if (r < min_rows)
+      r = min_rows;
+    rows[p] = r;
+    left -= r;
+  }
+}
+
+/* Equilibrage dynamique : a partir des temps CPU et GPU de la derniere
+ * iteration, on repartit les lignes au prorata des debits mesures. Les
+ * debits sont lisses pour ne pas osciller sur une mesure bruitee. */
+struct balance {
+  double rate_cpu;                      // rows per ms
+  double rate_gpu[MAX_DEVICES];
+};
+
+static void rebalance(struct balance *b, int rows_cpu, double time_cpu,
+		      int nb, const int *work_gpu, const double *time_gpu, int *rows_gpu,
+		      int slab_min, int ydim_gpu_max)
+{
+  double rate_gpu = 0.0;
+  int target;
+
+  // Less than a microsecond is below the timers resolution
+  if (time_cpu < 1e-3)
+    time_cpu = 1e-3;
+  b->rate_cpu = (b->rate_cpu == 0.0) ? rows_cpu / time_cpu :
+    0.5*(b->rate_cpu + rows_cpu / time_cpu);
+  for(int p = 0; p < nb; p++) {
+    double t = (time_gpu[p] < 1e-3) ? 1e-3 : time_gpu[p];
+
+    b->rate_gpu[p] = (b->rate_gpu[p] == 0.0) ? work_gpu[p] / t :
+      0.5*(b->rate_gpu[p] + work_gpu[p] / t);
+    rate_gpu += b->rate_gpu[p];
+  }
+
+  target = par.ydim * rate_gpu / (b->rate_cpu + rate_gpu);
+  target = (target + SPLIT_STEP/2) / SPLIT_STEP * SPLIT_STEP;
+  if (target < nb*slab_min)
+    target = nb*slab_min;
+  if (target > ydim_gpu_max)
+    target = ydim_gpu_max;
+  split_rows(target, nb, b->rate_gpu, rows_gpu, slab_min, SPLIT_STEP);
+}
+
+/* Debit de crete d'un device, pour le premier partage entre les tranches.
+ * Ce n'est qu'une estimation : --balance la corrige par les temps mesures. */
+static double device_speed(cl_device_id device)
+{
+  cl_uint units = 1, clock = 1;
+
+  clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+  clGetDeviceInfo(device, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(clock), &clock, NULL);
+  return (double)units * clock;
+}
+
+/* Deplacement des frontieres entre les parties apres un echange : les
+ * lignes [first - halo, last + halo) de chaque tranche sont alors a jour
+ * dans ses buffers, celles du CPU et les bords lus dans h_last. Chaque
+ * tranche renvoie d'abord vers l'hote celles de ses lignes dont une autre
+ * partie aura besoin, puis recoit celles qui lui manquent. Celles qui
+ * partagent les grilles de l'hote n'ont rien a transferer. */
+static void move_slabs(struct slab *slabs, int nb_slabs, const int *rows_gpu, store_t *h_last,
+		       int i)
+{
+  int first[MAX_DEVICES], last[MAX_DEVICES];
+
+  for(int y = par.ydim, n = nb_slabs - 1; n >= 0; n--) {
+    last[n] = y;
+    first[n] = y -= rows_gpu[n];
+  }
+
+  for(int n = 0; n < nb_slabs; n++) {
+    struct slab *s = &slabs[n];
+    cl_mem d_last = (i % 2 == 0) ? s->d_odata : s->d_idata;
+    int top = (first[n] + par.halo < s->last) ? first[n] + par.halo : s->last;
+    int bottom = (last[n] - par.halo > s->first) ? last[n] - par.halo : s->first;
+
+    if (s->first < top && !s->zero_copy)
+      read_rows(s->queue, d_last, h_last, s->base, s->first, top);
+    if (bottom < s->last && !s->zero_copy)
+      read_rows(s->queue, d_last, h_last, s->base, bottom > top ? bottom : top, s->last);
+  }
+
+  for(int n = 0; n < nb_slabs; n++) {
+    struct slab *s = &slabs[n];
+    cl_mem d_last = (i % 2 == 0) ? s->d_odata : s->d_idata;
+    int lo = (first[n] < par.halo) ? 0 : first[n] - par.halo;
+    int hi = (last[n] + par.halo > par.ydim) ? par.ydim : last[n] + par.halo;
+    int valid_lo = (s->first < par.halo) ? 0 : s->first - par.halo;
+    int valid_hi = (s->last + par.halo > par.ydim) ? par.ydim : s->last + par.halo;
+
+    if (lo < valid_lo && !s->zero_copy)
+      write_rows(s->queue, d_last, h_last, s->base, lo, (hi < valid_lo) ? hi : valid_lo);
+    if (valid_hi < hi && !s->zero_copy)
+      write_rows(s->queue, d_last, h_last, s->base, (lo > valid_hi) ? lo : valid_hi, hi);
+    s->first = first[n];
+    s->last = last[n];
+  }
+}
+
+#ifndef STENCIL_LIBRARY
+static void usage(void)
+{
+  fprintf(stderr,
+	  "Usage: stencil [options]\n"
+	  "  --gpu-only | --cpu-only   restrict the OpenCL device type\n"
+	  "  --devices N               use the first N devices only (default: all)\n"
+	  "  --zero-copy               compute in place in the host grids on the devices\n"
+	  "                            sharing host memory (CPU, integrated GPU); needs\n"
+	  "                            --halo 1 and a grid height multiple of 4\n"
+	  "  --device-columns C        cut the GPU part in bands of C devices side by\n"
+	  "                            side, in blocks of 64 columns: smaller halos at\n"
+	  "                            high device counts (default 1, not with --balance)\n"
+	  "  --size N                  square grid of N x N points\n"
+	  "  --xdim N, --ydim N        grid width and height (default %dx%d)\n"
+	  "  --ydim-gpu N              rows computed by the device (default %d)\n"
+	  "  --iterations N            number of time steps (default %d)\n"
+	  "  --balance                 move the CPU/GPU split to balance the load\n"
+	  "  --halo K                  exchange K ghost rows every K iterations\n"
+	  "  --cpu-kernel NAME         avx512, avx2, sse or scalar, f16c with fp16 storage\n"
+	  "                            (default: best supported)\n"
+	  "  --gpu-kernel NAME         naive, tiled, float4, fused or auto: the fastest\n"
+	  "                            found by --autotune for each device, naive\n"
+	  "                            without tuning (default: auto)\n"
+	  "  --autotune                time the GPU kernels with every work group shape\n"
+	  "                            and rows per work item on each device for the\n"
+	  "                            grid width, keep the best in the --cl-cache\n"
+	  "                            directory for the next runs, then run as usual\n"
+	  "  --threads N               CPU compute threads (default: one per core left)\n"
+	  "  --affinity MODE           pin them: compact (fill a NUMA node first), spread\n"
+	  "                            (one node after the other) or none (default: compact)\n"
+	  "  --driver-core N|none      core kept for the thread driving the devices, which\n"
+	  "                            does not compute (default: the first core)\n"
+	  "  --in-place                update a single host grid in place, with a few\n"
+	  "                            lines per thread, instead of two grids: needs\n"
+	  "                            --ydim-gpu 0 and one iteration per pass; with\n"
+	  "                            --validate sample, digest or none the host holds\n"
+	  "                            one grid in all\n"
+	  "  --huge-pages MODE         back the host grids with 2 MiB pages: transparent\n"
+	  "                            (thp), reserved (explicit, thp if none are left)\n"
+	  "                            or none, 4 KiB pages (default: thp)\n"
+	  "  --time-block T            iterations per pass through memory, on the CPU and\n"
+	  "                            with the fused GPU kernel; at most K when the grid\n"
+	  "                            is shared with the device (default 1)\n"
+	  "Convergence:\n"
+	  "  --tolerance EPS           stop once the norm of an iteration's update is\n"
+	  "                            below EPS, after --iterations at most (default 0:\n"
+	  "                            always run --iterations); a norm that is not finite\n"
+	  "                            (the grid has blown up) never passes\n"
+	  "  --check-every M           iterations between two checks (default 10)\n"
+	  "  --norm max|l2             norm of the update (default max)\n"
+	  "Validation:\n"
+	  "  --validate MODE           check the result against the reference computed\n"
+	  "                            on one thread (full) or on the compute threads\n"
+	  "                            (parallel), against the reference of random tiles\n"
+	  "                            only (sample), against the digest of a former run\n"
+	  "                            (digest), or not at all (none); without a full\n"
+	  "                            reference only the run time is given (default full)\n"
+	  "  --sample-tiles N          tiles of 16x16 points checked by sample, each one\n"
+	  "                            recomputed from the points it depends on (default 64)\n"
+	  "  --sample-seed N           seed of the tiles drawn by sample, given by a failed\n"
+	  "                            check to replay it (default the current time)\n"
+	  "  --golden FILE             digests of the final grids for digest, one per grid\n"
+	  "                            size, iterations, storage, device count, --halo,\n"
+	  "                            --time-block, --in-place, --device-columns, CPU\n"
+	  "                            kernel and rows and kernel of each device; a run\n"
+	  "                            without a digest fails (not with --balance)\n"
+	  "  --golden-record           add the digest of a run missing from the file\n"
+	  "Grid files:\n"
+	  "  --load FILE               start from the grid saved in FILE, which also sets\n"
+	  "                            the grid size; --iterations counts from the\n"
+	  "                            initial grid, the run goes on where FILE stopped;\n"
+	  "                            FILE is mapped as the grid of the run, not copied\n"
+	  "  --no-checksum             do not check the --load file, its pages are only\n"
+	  "                            read as the run reaches them\n"
+	  "  --save FILE               write the final grid to FILE\n"
+	  "  --checkpoint N            also write it to the --save file every N iterations,\n"
+	  "                            in the background\n"
+	  "  --cl-cache DIR|none       keep the compiled OpenCL programs and the kernel\n"
+	  "                            tuning in DIR (default: $XDG_CACHE_HOME/stencil2d\n"
+	  "                            or ~/.cache/stencil2d)\n"
+	  "  --trace FILE              write a timeline of the kernels, transfers and CPU\n"
+	  "                            passes to FILE (Chrome/Perfetto JSON) and print the\n"
+	  "                            time spent in each phase\n"
+	  "Out of core mode:\n"
+	  "  --out-of-core FILE        keep the grid in the grid file FILE (created with\n"
+	  "                            the initial grid if missing) and stream it through\n"
+	  "                            the first device by slabs, --time-block iterations\n"
+	  "                            per pass\n"
+	  "  --slab-rows N             rows per slab (default: the two slabs in flight\n"
+	  "                            take half of the device memory)\n"
+	  "Batch mode:\n"
+	  "  --batch N                 compute N independent grids of --xdim x --ydim\n"
+	  "                            points, each device all of its grids at once in\n"
+	  "                            one launch per iteration; a grid is never split\n"
+	  "                            (--ydim-gpu, --balance and --halo do not apply)\n"
+	  "  --batch-gpu G             grids computed by the devices, the others by the\n"
+	  "                            CPU threads (default: all of them, none without\n"
+	  "                            OpenCL device)\n"
+	  "Benchmark mode:\n"
+	  "  --bench FILE              measure every point of the sweeps below and write\n"
+	  "                            the results to FILE (graph.dat columns, or JSON if\n"
+	  "                            FILE ends in .json, - for stdout)\n"
+	  "  --sweep-size LIST         square grid sizes (default: --xdim x --ydim)\n"
+	  "  --sweep-iterations LIST   iteration counts (default: --iterations)\n"
+	  "  --sweep-ydim-gpu LIST     GPU parts (default: --ydim-gpu)\n"
+	  "  --sweep-gpu-kernel LIST   GPU kernels, by name (default: --gpu-kernel)\n"
+	  "  --repeat N                measured runs per point (default 5)\n"
+	  "  --warmup N                unmeasured runs before them (default 1)\n"
+	  "  LIST is a,b,c or first:last:step\n"
+	  "Points are stored as %s. The format is chosen when building stencil, with\n"
+	  "DEFINES=\"-DSTORAGE=FP16\", BF16 or FP64: compare formats with one build each.\n"
+	  "In fp16 a new grid is scaled by 32768/RAND_MAX/1.75^iterations to stay within\n"
+	  "half, and takes at most 36 iterations. The stencil is linear: the results are\n"
+	  "those of fp32 times this factor, the speed compares, the values do not.\n",
+	  XDIM, YDIM, YDIM_GPU, NUM_ITERATION, storage_names[STORAGE]);
+  exit(EXIT_FAILURE);
+}
+
+static int int_arg(const char *opt, const char *val)
+{
+  char *end;
+  long v;
+
+  if (val == NULL)
+    error("%s expects a value\n", opt);
+  v = strtol(val, &end, 10);
+  if (*end != '\0' || v < 0)
+    error("%s expects a non-negative integer, got \"%s\"\n", opt, val);
+  return (int)v;
+}
+#endif
+
+/* Environnement OpenCL, commun a tous les calculs du processus. Le
+ * programme est recompile quand la largeur de la grille ou la profondeur
+ * des blocs en temps changent. */
+static cl_context context;
+static cl_program program;
+static cl_device_id devices[MAX_DEVICES];
+static cl_uint nb_devices = 0;
+static const char *source;              // stencil.cl
+static char build_options[64];          // options of the last build
+static char *cl_cache;                  // --cl-cache, NULL for no cache
+
+static void opencl_init(cl_device_type device_type)
+{
+  cl_platform_id	pf[3];
+  cl_uint nb_platforms = 0;
+  cl_uint p = 0;
+  cl_int err;
+
+  // Get list of OpenCL platforms detected
+  //
+  err = clGetPlatformIDs(3, pf, &nb_platforms);
+  check(err, "Failed to get platform IDs");
+
+  if (!QUIET) printf("%d OpenCL platforms detected\n", nb_platforms);
+
+  // Print name & vendor for each platform
+  //
+  for (unsigned int _p=0; _p<nb_platforms; _p++) {
+    cl_uint num;
+    int platform_valid = 1;
+    char name[1024], vendor[1024];
+
+    err = clGetPlatformInfo(pf[_p], CL_PLATFORM_NAME, 1024, name, NULL);
+    check(err, "Failed to get Platform Info");
+
+    err = clGetPlatformInfo(pf[_p], CL_PLATFORM_VENDOR, 1024, vendor, NULL);
+    check(err, "Failed to get Platform Info");
+
+    if (!QUIET) printf("Platform %d: %s - %s\n", _p, name, vendor);
+
+    if(strstr(vendor, "NVIDIA")) {
+      p = _p;
+      if (!QUIET) printf("Choosing platform %d\n", p);
+    }
+  }
+
+  // Get list of devices
+  //
+  err = clGetDeviceIDs(pf[p], device_type, MAX_DEVICES, devices, &nb_devices);
+  if (!QUIET) printf("nb devices = %d\n", nb_devices);
+  if (par.devices != 0 && (cl_uint)par.devices < nb_devices)
+    nb_devices = par.devices;
+  if (nb_devices == 0)
+    return;
+
+#if STORAGE == FP64
+  // The kernels compute in double
+  for (cl_uint d = 0; d < nb_devices; d++) {
+    cl_device_fp_config fp64 = 0;
+
+    clGetDeviceInfo(devices[d], CL_DEVICE_DOUBLE_FP_CONFIG, sizeof(fp64), &fp64, NULL);
+    if (fp64 == 0)
+      error("device %u does not support double precision (cl_khr_fp64)\n", d);
+  }
+#endif
+
+  // Create compute context with "device_type" devices
+  //
+  context = clCreateContext (0, nb_devices, devices, NULL, NULL, &err);
+  check(err, "Failed to create compute context");
+
+  // Load program source, built by opencl_build()
+  source = load(getenv("STENCIL_CL") != NULL ? getenv("STENCIL_CL") : "stencil.cl");
+}
+
+/* Cache des programmes compiles (--cl-cache DIR) : un fichier par jeu de
+ * binaires, nomme par une empreinte du source, des options de compilation
+ * et des devices (nom, version du pilote). Au lancement suivant avec les
+ * memes parametres le programme est cree a partir des binaires, sans
+ * passer par le compilateur. Un fichier illisible ou refuse par le
+ * runtime est ignore et reecrit. */
+#define CL_CACHE_MAGIC "STENCILCL"
+
+static uint64_t fnv1a(uint64_t sum, const void *data, size_t n)
+{
+  for(size_t i = 0; i < n; i++)
+    sum = (sum ^ ((const unsigned char *)data)[i]) * 1099511628211ULL;
+  return sum;
+}
+
+/* Repertoire du cache, cree au besoin, faux si le cache n'est pas
+ * utilise */
+static int cache_dir(char *dir, size_t size)
+{
+  if (cl_cache == NULL)
+    return 0;
+  snprintf(dir, size, "%s", cl_cache);
+  mkdir(dir, 0755);
+  return 1;
+}
+
+#ifndef STENCIL_LIBRARY
+/* Repertoire du cache de stencil sans --cl-cache, faux s'il n'y en a
+ * pas. La bibliotheque n'en a pas par defaut. */
+static int default_cache_dir(char *dir, size_t size)
+{
+  if (getenv("XDG_CACHE_HOME") != NULL)
+    snprintf(dir, size, "%s/stencil2d", getenv("XDG_CACHE_HOME"));
+  else if (getenv("HOME") != NULL) {
+    snprintf(dir, size, "%s/.cache", getenv("HOME"));
+    mkdir(dir, 0755);
+    snprintf(dir, size, "%s/.cache/stencil2d", getenv("HOME"));
+  } else
+    return 0;
+  return 1;
+}
+#endif
+
+/* Empreinte d'un device : nom, vendeur et versions du pilote */
+static uint64_t device_key(uint64_t key, cl_device_id device)
+{
+  const cl_device_info infos[] = { CL_DEVICE_NAME, CL_DEVICE_VENDOR, CL_DRIVER_VERSION, CL_DEVICE_VERSION };
+
+  for(unsigned int k = 0; k < sizeof(infos)/sizeof(infos[0]); k++) {
+    char info[1024] = "";
+
+    clGetDeviceInfo(device, infos[k], sizeof(info) - 1, info, NULL);
+    key = fnv1a(key, info, strlen(info) + 1);
+  }
+  return key;
+}
+
+/* Fichier du cache pour les options de compilation options, faux si le
+ * cache n'est pas utilise */
+static int cl_cache_file(const char *options, char *file, size_t size)
+{
+  uint64_t key = fnv1a(14695981039346656037ULL, source, strlen(source) + 1);
+  char dir[1024];
+
+  if (!cache_dir(dir, sizeof(dir)))
+    return 0;
+  key = fnv1a(key, options, strlen(options) + 1);
+  for(cl_uint d = 0; d < nb_devices; d++)
+    key = device_key(key, devices[d]);
+  snprintf(file, size, "%s/%016llx.bin", dir, (unsigned long long)key);
+  return 1;
+}
+
+/* Programme cree a partir des binaires du fichier, NULL si le fichier
+ * manque ou ne convient pas */
+static cl_program cl_cache_load(const char *file)
+{
+  FILE *f = fopen(file, "rb");
+  char magic[sizeof(CL_CACHE_MAGIC)];
+  uint32_t nb = 0;
+  size_t sizes[MAX_DEVICES];
+  unsigned char *binaries[MAX_DEVICES] = { NULL };
+  cl_program p = NULL;
+  cl_int err = CL_INVALID_BINARY;
+  int ok;
+
+  if (f == NULL)
+    return NULL;
+  ok = fread(magic, sizeof(magic), 1, f) == 1 && !memcmp(magic, CL_CACHE_MAGIC, sizeof(magic)) &&
+    fread(&nb, sizeof(nb), 1, f) == 1 && nb == nb_devices;
+  for(uint32_t d = 0; ok && d < nb; d++) {
+    uint64_t size;
+
+    ok = fread(&size, sizeof(size), 1, f) == 1 && size > 0 && size < (1ULL << 31) &&
+      (binaries[d] = malloc(size)) != NULL && fread(binaries[d], size, 1, f) == 1;
+    sizes[d] = size;
+  }
+  fclose(f);
+  if (ok)
+    p = clCreateProgramWithBinary(context, nb_devices, devices, sizes,
+				  (const unsigned char **)binaries, NULL, &err);
+  for(uint32_t d = 0; d < nb; d++)
+    free(binaries[d]);
+  return (err == CL_SUCCESS) ? p : NULL;
+}
+
+/* Ecriture des binaires du programme compile. Le cache n'est qu'une
+ * optimisation : une erreur laisse le fichier absent. Chaque processus
+ * ecrit son propre fichier temporaire. */
+static void cl_cache_save(const char *file)
+{
+  char tmp[strlen(file) + 16];
+  size_t sizes[MAX_DEVICES];
+  unsigned char *binaries[MAX_DEVICES] = { NULL };
+  uint32_t nb = nb_devices;
+  cl_int err;
+  FILE *f;
+  int ok;
+
+  err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(sizes[0])*nb_devices, sizes, NULL);
+  for(cl_uint d = 0; err == CL_SUCCESS && d < nb_devices; d++)
+    if (sizes[d] == 0 || (binaries[d] = malloc(sizes[d])) == NULL)
+      err = CL_OUT_OF_HOST_MEMORY;
+  if (err == CL_SUCCESS)
+    err = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries[0])*nb_devices, binaries, NULL);
+
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int)getpid());
+  if (err == CL_SUCCESS && (f = fopen(tmp, "wb")) != NULL) {
+    ok = fwrite(CL_CACHE_MAGIC, sizeof(CL_CACHE_MAGIC), 1, f) == 1 &&
+      fwrite(&nb, sizeof(nb), 1, f) == 1;
+    for(cl_uint d = 0; ok && d < nb_devices; d++) {
+      uint64_t size = sizes[d];
+
+      ok = fwrite(&size, sizeof(size), 1, f) == 1 && fwrite(binaries[d], sizes[d], 1, f) == 1;
+    }
+    if (fclose(f) != 0 || !ok || rename(tmp, file) < 0)
+      unlink(tmp);
+  }
+  for(cl_uint d = 0; d < nb_devices; d++)
+    free(binaries[d]);
+}
+
+static void opencl_build(void)
+{
+  char options[sizeof(build_options)];
+  char file[1100];
+  int cache;
+  cl_int err;
+
+  // The line size is fixed at build time so that the kernel indexing
+  // is as cheap as with the former compile-time constants
+  //
+  snprintf(options, sizeof(options), "-DLINESIZE=%u -DTIME_BLOCK=%d -DSTORAGE=%d",
+	   (unsigned int)LINESIZE, par.time_block, STORAGE);
+  if (!strcmp(options, build_options))
+    return;
+  cache = cl_cache_file(options, file, sizeof(file));
+  if (program != NULL)
+    clReleaseProgram(program);
+  program = cache ? cl_cache_load(file) : NULL;
+
+  // Programs from binaries are still built, without compiling
+  if (program != NULL && clBuildProgram(program, 0, NULL, options, NULL, NULL) != CL_SUCCESS) {
+    clReleaseProgram(program);
+    program = NULL;
+  }
+  if (!QUIET && cache) printf("Program cache: %s (%s)\n", program ? "hit" : "miss", file);
+  if (program == NULL) {
+    program = clCreateProgramWithSource(context, 1, &source, NULL, &err);
+    check(err, "Failed to create program");
+    err = clBuildProgram (program, 0, NULL, options, NULL, NULL);
+    check(err, "Failed to build program");
+    if (cache)
+      cl_cache_save(file);
+  }
+  strcpy(build_options, options);
+}
+
+/* Reglages des noyaux (--autotune) : un fichier texte par device dans le
+ * repertoire du cache, nomme par une empreinte du source et du device.
+ * Une ligne par variante mesuree pour une largeur de grille, une
+ * profondeur des blocs en temps et un format des points :
+ *   xdim time_block storage kernel local0 local1 rows ms
+ * ms est la duree d'une iteration des lignes mesurees. */
+static int tune_file(cl_device_id device, char *file, size_t size)
+{
+  uint64_t key = fnv1a(14695981039346656037ULL, source, strlen(source) + 1);
+  char dir[1024];
+
+  if (!cache_dir(dir, sizeof(dir)))
+    return 0;
+  key = device_key(key, device);
+  snprintf(file, size, "%s/%016llx.tune", dir, (unsigned long long)key);
+  return 1;
+}
+
+/* Lecture d'une ligne du fichier de reglages dans k, faux si elle ne
+ * decrit pas une variante connue */
+static int tune_parse(const char *line, int *xdim, int *time_block, int *storage,
+		      struct gpu_kernel *k, double *ms)
+{
+  char name[32];
+  unsigned long local0, local1;
+  int rows;
+
+  if (sscanf(line, "%d %d %d %31s %lu %lu %d %lf", xdim, time_block, storage,
+	     name, &local0, &local1, &rows, ms) != 8)
+    return 0;
+  for(unsigned int n = 0; n < NB_GPU_KERNELS; n++)
+    if (!strcmp(name, gpu_kernels[n].name)) {
+      *k = gpu_kernels[n];
+      if (!k->tunable)
+	return local0 == k->local[0] && local1 == k->local[1] && rows == k->rows;
+      if (local0 == 0 || local1 == 0 || rows <= 0 || SPLIT_STEP % (rows*local1) != 0)
+	return 0;
+      k->local[0] = local0;
+      k->local[1] = local1;
+      k->rows = rows;
+      return 1;
+    }
+  return 0;
+}
+
+/* Meilleure variante reglee pour le device et les parametres du calcul
+ * (celle de --gpu-kernel si elle est choisie), mesuree pour la largeur
+ * la plus proche. Faux sans reglage qui convienne. */
+static int tune_load(cl_device_id device, struct gpu_kernel *k)
+{
+  char file[1100], line[256];
+  int best = -1;
+  double best_ms = 0;
+  FILE *f;
+
+  if (!tune_file(device, file, sizeof(file)) || (f = fopen(file, "r")) == NULL)
+    return 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    struct gpu_kernel t;
+    int xdim, time_block, storage, dist;
+    double ms;
+
+    if (!tune_parse(line, &xdim, &time_block, &storage, &t, &ms) ||
+	time_block != par.time_block || storage != STORAGE ||
+	(gpu_kernel != NULL && strcmp(t.name, gpu_kernel->name)) ||
+	!kernel_fits(&t) || !fused_fits(device, &t))
+      continue;
+    dist = abs(xdim - par.xdim);
+    if (best < 0 || dist < best || (dist == best && ms < best_ms)) {
+      best = dist;
+      best_ms = ms;
+      *k = t;
+    }
+  }
+  fclose(f);
+  return best >= 0;
+}
+
+#ifndef STENCIL_LIBRARY
+/* Enregistrement du reglage de la variante k pour les parametres du
+ * calcul, a la place du precedent. Comme pour le cache des programmes
+ * une erreur est ignoree. */
+static void tune_save(cl_device_id device, const struct gpu_kernel *k, double ms)
+{
+  char file[1100], tmp[1200], line[256];
+  FILE *f, *out;
+
+  if (!tune_file(device, file, sizeof(file)))
+    return;
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int)getpid());
+  if ((out = fopen(tmp, "w")) == NULL)
+    return;
+  if ((f = fopen(file, "r")) != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      struct gpu_kernel t;
+      int xdim, time_block, storage;
+      double t_ms;
+
+      if (tune_parse(line, &xdim, &time_block, &storage, &t, &t_ms) &&
+	  xdim == par.xdim && time_block == par.time_block && storage == STORAGE &&
+	  !strcmp(t.name, k->name))
+	continue;
+      fputs(line, out);
+    }
+    fclose(f);
+  }
+  fprintf(out, "%d %d %d %s %zu %zu %d %g\n", par.xdim, par.time_block, STORAGE,
+	  k->name, k->local[0], k->local[1], k->rows, ms);
+  if (fclose(out) != 0 || rename(tmp, file) < 0)
+    unlink(tmp);
+}
+#endif
+
+/* Variante et geometrie des lancements sur le device d : celle de
+ * --gpu-kernel, avec son reglage s'il y en a un, sinon la meilleure
+ * reglee, sinon naive */
+static struct gpu_kernel device_kernel(int d)
+{
+  struct gpu_kernel k = (gpu_kernel != NULL) ? *gpu_kernel : gpu_kernels[0];
+
+  tune_load(devices[d], &k);
+  return k;
+}
+
+#ifndef STENCIL_LIBRARY
+/* Duree moyenne d'une iteration de la variante k sur les lignes [0, rows)
+ * des buffers de s, en ms, apres un lancement de chauffe */
+static double time_kernel(struct slab *s, const struct gpu_kernel *k, int rows)
+{
+  const int nb_launches = 10;
+  int nsteps = k->fused ? par.time_block : 1;
+  cl_event events[nb_launches];
+  double total = 0;
+  cl_int err;
+
+  s->gk = *k;
+  s->kernel = clCreateKernel(program, k->entry, &err);
+  check(err, "Failed to create compute kernel!\n");
+  for(int l = -1; l < nb_launches; l++) {
+    cl_event *event = (l < 0) ? NULL : &events[l];
+
+    if (k->fused)
+      launch_rect_fused(s, s->d_odata, s->d_idata, 0, par.xdim, 0, rows, nsteps, 0, NULL, event);
+    else
+      launch_rows(s, s->d_odata, s->d_idata, 0, rows, 0, NULL, event);
+  }
+  err = clFinish(s->queue);
+  check(err, "Failed to wait for the kernels!\n");
+  for(int l = 0; l < nb_launches; l++) {
+    total += event_time(events[l]);
+    clReleaseEvent(events[l]);
+  }
+  clReleaseKernel(s->kernel);
+  return total / (nb_launches * nsteps);
+}
+
+/* Recherche, pour chaque device, de la forme des work-groups, du nombre
+ * de lignes par work-item et de la variante les plus rapides pour la
+ * largeur de la grille, sur la part de lignes que le device aurait. Le
+ * meilleur reglage de chaque variante est enregistre pour les
+ * lancements suivants. */
+static void autotune(void)
+{
+  int rows = (par.ydim_gpu != 0 ? par.ydim_gpu : par.ydim) / nb_devices / SPLIT_STEP * SPLIT_STEP;
+  cl_int err;
+
+  if (nb_devices == 0)
+    error("no OpenCL device found\n");
+  if (rows == 0)
+    rows = SPLIT_STEP;
+  opencl_build();
+  for(cl_uint d = 0; d < nb_devices; d++) {
+    struct slab s = { .device = devices[d], .base = 0, .end = rows, .right = par.xdim };
+    size_t size = LINESIZE*(rows + 2*BORDER)*sizeof(store_t);
+    size_t max_group, max_items[3];
+    store_t *zero = memset(arena_alloc(size), 0, size);
+    char name[1024];
+
+    err = clGetDeviceInfo(s.device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+    err |= clGetDeviceInfo(s.device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
+    err |= clGetDeviceInfo(s.device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(max_items), max_items, NULL);
+    check(err, "Cannot get device info");
+    s.queue = clCreateCommandQueue(context, s.device, CL_QUEUE_PROFILING_ENABLE, &err);
+    check(err,"Failed to create a command queue!\n");
+    s.d_idata = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, zero, NULL);
+    s.d_odata = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, zero, NULL);
+    if (!s.d_idata || !s.d_odata)
+      error("Failed to allocate device memory!\n");
+    arena_free(zero);
+    if (!QUIET) printf("Autotuning device %u [%s], %d rows\n", d, name, rows);
+
+    // The fixed variants are timed as they are, the tunable ones for
+    // every work group shape the device accepts. A work group spans a
+    // divisor of SPLIT_STEP rows so that every slab is made of whole
+    // work groups.
+    //
+    for(unsigned int n = 0; n < NB_GPU_KERNELS; n++) {
+      struct gpu_kernel best = gpu_kernels[n];
+      double best_ms = -1;
+
+      for(size_t local0 = 4; local0 <= 256; local0 *= 2)
+	for(size_t local1 = 1; local1 <= SPLIT_STEP; local1 *= 2)
+	  for(int r = 1; r*local1 <= SPLIT_STEP; r *= 2) {
+	    struct gpu_kernel k = gpu_kernels[n];
+	    double ms;
+
+	    if (k.tunable) {
+	      k.local[0] = local0;
+	      k.local[1] = local1;
+	      k.rows = r;
+	    } else if (local0 != k.local[0] || local1 != k.local[1] || r != k.rows)
+	      continue;
+	    if (k.local[0]*k.local[1] > max_group || k.local[0] > max_items[0] ||
+		k.local[1] > max_items[1] || !kernel_fits(&k) || !fused_fits(s.device, &k))
+	      continue;
+	    ms = time_kernel(&s, &k, rows);
+	    if (!QUIET) printf("  %-6s %3zux%-2zu %2d rows/item  %8.4f ms\n",
+			       k.name, k.local[0], k.local[1], k.rows, ms);
+	    if (best_ms < 0 || ms < best_ms) {
+	      best = k;
+	      best_ms = ms;
+	    }
+	  }
+      if (best_ms < 0)
+	continue;
+      tune_save(s.device, &best, best_ms);
+      if (!QUIET) printf("Best %s: %zux%zu, %d rows per item, %.4f ms per iteration\n",
+			 best.name, best.local[0], best.local[1], best.rows, best_ms);
+    }
+    clReleaseMemObject(s.d_idata);
+    clReleaseMemObject(s.d_odata);
+    clReleaseCommandQueue(s.queue);
+  }
+}
+#endif
+
+/* Verification des parametres d'un calcul */
+static void check_params(void)
+{
+  // The kernel works on 16-wide work groups of 4x4 rows
+  //
+  if (par.xdim == 0 || par.xdim % 16 != 0)
+    error("the grid width must be a non-zero multiple of 16\n");
+  if (par.ydim == 0)
+    error("the grid height must be non-zero\n");
+  if (par.halo == 0)
+    error("the halo depth must be at least 1\n");
+  if (par.time_block == 0)
+    error("the time block depth must be at least 1\n");
+  if (par.tolerance < 0 || (par.tolerance > 0 && par.check_every == 0))
+    error("the convergence tolerance must be positive, checked every 1 or more iterations\n");
+  if (par.ydim_gpu > par.ydim || par.ydim_gpu % SPLIT_STEP != 0)
+    error("the GPU part must be a multiple of %d rows not larger than the grid\n", SPLIT_STEP);
+  // In place, the ghost rows of a device would be the rows of its
+  // neighbours; the buffers start at the first line of the grid
+  if (par.zero_copy && (par.halo != 1 || par.ydim % 4 != 0))
+    error("--zero-copy needs --halo 1 and a grid height multiple of 4\n");
+  // Each column of devices holds at least its halo, in whole COL_STEP
+  if (par.device_columns == 0 ||
+      (par.device_columns > 1 && par.xdim < par.device_columns*ROUND_UP(par.halo, COL_STEP)))
+    error("the grid is too narrow for %d device columns with a halo of %d\n",
+	  par.device_columns, par.halo);
+  if (par.device_columns > 1 && par.balance)
+    error("--balance only moves rows, not with --device-columns\n");
+  // In place there is no previous state to send, to read back nor to
+  // block in time from
+  if (par.in_place && (par.ydim_gpu != 0 || par.balance || par.time_block != 1))
+    error("--in-place needs the whole grid on the CPU (--ydim-gpu 0), without --balance "
+	  "nor --time-block\n");
+}
+
+/* Premier contact des lignes [lo, hi) d'une grille, bords compris */
+static void touch_rows(char *g, size_t line, int lo, int hi)
+{
+  int first = (lo == 0) ? 0 : lo + 1;
+  int last = (hi == par.ydim) ? par.ydim + 2 : hi + 1;
+
+  if (lo < hi)
+    memset(g + line*first, 0, line*(last - first));
+}
+
+/* Grilles de l'hote, alignees pour les noyaux CPU et --zero-copy, et
+ * leur contenu initial (toujours le meme, pour comparer les resultats).
+ * Les grilles de la reference sont toujours en float.
+ * Les pages d'une grille neuve sont ecrites une premiere fois en
+ * parallele : Linux les place dans la memoire du noeud NUMA du thread qui
+ * les touche le premier. Chaque thread de calcul ecrit sa bande de la
+ * partie CPU de depart, le pilote les lignes des devices, qu'il
+ * transfere. Une grille reprise a l'arene garde les pages d'avant, deja
+ * placees. */
+static void *alloc_points(size_t point_size)
+{
+  size_t line = LINESIZE*point_size;
+  // --bench allocates before leaving out the GPU parts too large
+  int rows_cpu = (par.ydim_gpu < par.ydim) ? par.ydim - par.ydim_gpu : 0;
+  void *h = arena_alloc(TOTALSIZE*point_size);
+
+  #pragma omp parallel num_threads(cpus.team)
+  {
+    int t = cpu_thread(), lo, hi;
+
+    if (t >= 0) {
+      thread_rows(t, 0, rows_cpu, &lo, &hi);
+      touch_rows(h, line, lo, hi);
+    }
+    // Without a driver thread the first compute thread stands in
+    if (t == (cpus.driver >= 0 ? -1 : 0))
+      touch_rows(h, line, rows_cpu, par.ydim);
+  }
+  return h;
+}
+
+static store_t *alloc_grid(void)
+{
+  return alloc_points(sizeof(store_t));
+}
+
+#ifndef STENCIL_LIBRARY
+static float *alloc_reference(void)
+{
+  return alloc_points(sizeof(float));
+}
+#endif
+
+/* Le stencil multiplie les valeurs par jusqu'a 1.75 par iteration et
+ * rand() depasse deja le plus grand half (65504) : en FP16 la grille
+ * initiale est reduite pour que le resultat tienne encore en half. Au-dela
+ * de FP16_MAX_ITERATION iterations les valeurs de depart ne seraient plus
+ * normalisees (2^-14), puis nulles. Le stencil est lineaire : le resultat
+ * est celui des autres formats multiplie par INIT_SCALE, les durees se
+ * comparent mais pas les valeurs. */
+#if STORAGE == FP16
+	#define INIT_SCALE (32768.0 / RAND_MAX / pow(1.75, par.num_iteration))
+	#define FP16_MAX_ITERATION 36
+#else
+	#define INIT_SCALE 1
+#endif
+
+#ifndef STENCIL_LIBRARY
+/* nb grilles rangees l'une apres l'autre (--batch) : les valeurs se
+ * suivent d'une grille a l'autre, la premiere est la grille habituelle */
+static void init_grids(store_t *h, int nb)
+{
+#if STORAGE == FP16
+  if (par.num_iteration > FP16_MAX_ITERATION)
+    error("fp16 storage holds a new grid for at most %d iterations\n", FP16_MAX_ITERATION);
+#endif
+  srand(1234);
+  for(size_t i = 0; i < nb*TOTALSIZE; i++)
+    h[i]=store_point(rand()*INIT_SCALE);
+}
+
+static void init_grid(store_t *h)
+{
+  init_grids(h, 1);
+}
+
+/* Grille de depart de la reference : la grille h telle qu'elle est
+ * stockee, convertie en float */
+static void init_reference(float *ref, const store_t *h)
+{
+  for(size_t i = 0; i < TOTALSIZE; i++)
+    ref[i] = load_point(h[i]);
+}
+#endif
+
+/* Fichiers de grille (--load, --save, --checkpoint, --out-of-core) : un
+ * en-tete d'une page, puis la grille telle qu'elle est en memoire (lignes
+ * de LINESIZE points, bords et padding compris). Les donnees commencent
+ * sur une page, elles se projettent avec mmap() sans copie ni
+ * conversion. */
+#define GRID_MAGIC   "STENCIL2D"
+#define GRID_VERSION 1
+#define GRID_HEADER  4096
+
+struct grid_header {
+  char magic[10];
+  uint16_t version;
+  uint32_t xdim, ydim;
+  uint32_t line_size;                   // LINESIZE, for other readers
+  uint32_t storage;                     // STORAGE of the points
+  uint64_t iteration;                   // iterations done since init_grid()
+  uint64_t checksum;                    // grid_checksum() of the data
+};
+
+static store_t *mapped_grid;            // grid loaded by load_grid()
+static store_t *initial_grid;           // the same, for the next plan
+#ifndef STENCIL_LIBRARY
+static int grid_verify = 1;             // checksum of the loaded grid
+#endif
+
+/* Somme de controle FNV-1a de la grille, par mots de 32 bits */
+static uint64_t grid_checksum(const store_t *h)
+{
+  const char *data = (const char *)h;
+  uint64_t sum = 14695981039346656037ULL;
+
+  // LINESIZE is even: a whole number of words in every format
+  for(size_t i = 0; i < TOTALSIZE*sizeof(store_t)/4; i++) {
+    uint32_t w;
+
+    memcpy(&w, data + 4*i, sizeof(w));
+    sum = (sum ^ w) * 1099511628211ULL;
+  }
+  return sum;
+}
+
+#ifndef STENCIL_LIBRARY
+/* Lecture et verification de l'en-tete du fichier ouvert dans fd, qui
+ * fixe les dimensions de la grille */
+static void read_header(int fd, const char *file, struct grid_header *hd)
+{
+  struct stat st;
+
+  if (pread(fd, hd, sizeof(*hd), 0) != sizeof(*hd) ||
+      memcmp(hd->magic, GRID_MAGIC, sizeof(hd->magic)) != 0)
+    error("%s is not a grid file\n", file);
+  if (hd->version != GRID_VERSION)
+    error("%s: unsupported grid file version %d\n", file, hd->version);
+  if (hd->storage != STORAGE)
+    error("%s holds %s points, this build stores %s\n", file,
+	  hd->storage <= FP64 ? storage_names[hd->storage] : "unknown",
+	  storage_names[STORAGE]);
+  par.xdim = hd->xdim;
+  par.ydim = hd->ydim;
+  if (hd->line_size != LINESIZE || fstat(fd, &st) < 0 ||
+      (size_t)st.st_size != GRID_HEADER + TOTALSIZE*sizeof(store_t))
+    error("%s is truncated or corrupted\n", file);
+}
+#endif
+
+static void write_header(int fd, const char *file, uint64_t iteration, uint64_t checksum)
+{
+  struct grid_header hd;
+
+  memset(&hd, 0, sizeof(hd));
+  memcpy(hd.magic, GRID_MAGIC, sizeof(hd.magic));
+  hd.version = GRID_VERSION;
+  hd.xdim = par.xdim;
+  hd.ydim = par.ydim;
+  hd.line_size = LINESIZE;
+  hd.storage = STORAGE;
+  hd.iteration = iteration;
+  hd.checksum = checksum;
+  if (pwrite(fd, &hd, sizeof(hd), 0) != sizeof(hd))
+    error("can not write %s\n", file);
+}
+
+#ifndef STENCIL_LIBRARY
+/* Projection en memoire de la grille du fichier ouvert dans fd */
+static store_t *map_grid(int fd, const char *file, int flags)
+{
+  store_t *g = mmap(NULL, TOTALSIZE*sizeof(store_t), PROT_READ | PROT_WRITE,
+		  flags, fd, GRID_HEADER);
+
+  if (g == MAP_FAILED)
+    error("can not map %s\n", file);
+  return g;
+}
+
+/* Grille initiale lue dans un fichier (--load), projetee en copie privee :
+ * le plan suivant la prend comme grille, sans copie, et les pages ne sont
+ * copiees que si on les ecrit. Sans grid_verify (--no-checksum) elles ne
+ * sont lues qu'au premier acces du calcul. Renvoie le nombre
+ * d'iterations deja faites dans *iteration. */
+static void load_grid(const char *file, uint64_t *iteration)
+{
+  struct grid_header hd;
+  int fd = open(file, O_RDONLY);
+
+  if (fd < 0)
+    error("can not open %s\n", file);
+  read_header(fd, file, &hd);
+  mapped_grid = map_grid(fd, file, MAP_PRIVATE);
+  close(fd);
+  if (grid_verify && grid_checksum(mapped_grid) != hd.checksum)
+    error("%s: wrong checksum\n", file);
+  *iteration = hd.iteration;
+  initial_grid = mapped_grid;
+}
+#endif
+
+/* Liberation d'une grille, allouee ou chargee */
+static void free_grid(store_t *h)
+{
+  if (h == mapped_grid) {
+    munmap(h, TOTALSIZE*sizeof(store_t));
+    mapped_grid = NULL;
+  } else
+    arena_free(h);
+}
+
+/* Ecriture de la grille h apres iteration iterations. Le fichier n'est
+ * remplace qu'une fois complet. */
+static void save_grid(const char *file, const store_t *h, uint64_t iteration)
+{
+  char tmp[strlen(file) + 5];
+  const char *data = (const char *)h;
+  size_t left = TOTALSIZE*sizeof(store_t);
+  off_t offset = GRID_HEADER;
+  int fd;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    error("can not create %s\n", tmp);
+  write_header(fd, tmp, iteration, grid_checksum(h));
+  while (left > 0) {
+    ssize_t n = pwrite(fd, data, left, offset);
+
+    if (n <= 0)
+      error("can not write %s\n", tmp);
+    data += n;
+    offset += n;
+    left -= n;
+  }
+  if (fsync(fd) < 0 || close(fd) < 0 || rename(tmp, file) < 0)
+    error("can not write %s\n", file);
+}
+
+/* Copie des bords de la grille src dans dst : les lignes du haut et du
+ * bas, et les 16 premiers points des autres lignes (le bord de droite
+ * d'une ligne est le premier point de la suivante) */
+static void copy_borders(store_t *dst, const store_t *src)
+{
+  memcpy(dst, src, LINESIZE*sizeof(store_t));
+  for(int l = 1; l <= par.ydim; l++)
+    memcpy(dst + l*LINESIZE, src + l*LINESIZE, 16*sizeof(store_t));
+  memcpy(dst + (par.ydim + 1)*LINESIZE, src + (par.ydim + 1)*LINESIZE,
+	 LINESIZE*sizeof(store_t));
+}
+
+/* Points de reprise (--checkpoint N) : toutes les N iterations, l'etat
+ * de la grille est rassemble dans un instantane qu'un thread ecrit dans
+ * le fichier de --save pendant que le calcul continue. Le calcul ne fait
+ * que copier les lignes du CPU, que le bloc suivant va reecrire, et
+ * mettre la lecture des lignes de chaque tranche dans la file de son
+ * device, derriere ses noyaux : c'est l'ecrivain qui attend ces
+ * lectures. Avec deux instantanes, le calcul n'attend que si les deux
+ * points de reprise precedents ne sont pas encore ecrits. */
+#define NB_SNAPSHOTS 2
+
+static struct {
+  const char *file;                     // --save
+  int every;                            // 0 for no checkpoints
+  uint64_t start;                       // iterations done on the initial grid
+  store_t *snapshot[NB_SNAPSHOTS];
+  uint64_t iteration[NB_SNAPSHOTS];     // of each snapshot
+  cl_event read[NB_SNAPSHOTS][MAX_DEVICES];     // slab rows in flight
+  int nb_read[NB_SNAPSHOTS];
+  int busy[NB_SNAPSHOTS];               // filled, not written yet
+  int next;                             // snapshot to fill
+  int stop;                             // no more snapshots in this run
+  int running;                          // writer thread started
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} ckpt = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* Ecrivain des instantanes, dans l'ordre ou ils sont remplis */
+static void *checkpoint_thread(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&ckpt.lock);
+  for(int b = 0; ; b = (b + 1) % NB_SNAPSHOTS) {
+    while (!ckpt.busy[b] && !ckpt.stop)
+      pthread_cond_wait(&ckpt.cond, &ckpt.lock);
+    if (!ckpt.busy[b])
+      break;
+    pthread_mutex_unlock(&ckpt.lock);
+
+    if (ckpt.nb_read[b] != 0)
+      clWaitForEvents(ckpt.nb_read[b], ckpt.read[b]);
+    for(int n = 0; n < ckpt.nb_read[b]; n++)
+      clReleaseEvent(ckpt.read[b][n]);
+    save_grid(ckpt.file, ckpt.snapshot[b], ckpt.iteration[b]);
+
+    pthread_mutex_lock(&ckpt.lock);
+    ckpt.busy[b] = 0;
+    pthread_cond_broadcast(&ckpt.cond);
+  }
+  pthread_mutex_unlock(&ckpt.lock);
+  return NULL;
+}
+
+/* Fin des points de reprise d'une execution : les instantanes en
+ * attente sont ecrits */
+static void checkpoint_wait(void)
+{
+  if (!ckpt.running)
+    return;
+  pthread_mutex_lock(&ckpt.lock);
+  ckpt.stop = 1;
+  pthread_cond_broadcast(&ckpt.cond);
+  pthread_mutex_unlock(&ckpt.lock);
+  pthread_join(ckpt.thread, NULL);
+  ckpt.running = ckpt.stop = 0;
+  ckpt.next = 0;
+  for(int b = 0; b < NB_SNAPSHOTS; b++) {
+    arena_free(ckpt.snapshot[b]);
+    ckpt.snapshot[b] = NULL;
+  }
+}
+
+/* Instantane apres l'iteration i, la derniere de h_last : les ydim_cpu
+ * premieres lignes viennent de l'hote, celles des tranches de leur
+ * device */
+static void checkpoint(const struct slab *slabs, int nb_slabs, const store_t *h_last,
+		       int ydim_cpu, int i)
+{
+  int b = ckpt.next;
+  store_t *snapshot;
+
+  pthread_mutex_lock(&ckpt.lock);
+  while (ckpt.busy[b])
+    pthread_cond_wait(&ckpt.cond, &ckpt.lock);
+  pthread_mutex_unlock(&ckpt.lock);
+
+  // The borders never change, they are copied once per run
+  if (ckpt.snapshot[b] == NULL) {
+    ckpt.snapshot[b] = alloc_grid();
+    copy_borders(ckpt.snapshot[b], h_last);
+  }
+  snapshot = ckpt.snapshot[b];
+
+  // The halo transfers in flight only write the slabs' rows of h_last
+  memcpy(snapshot + LINESIZE, h_last + LINESIZE, (size_t)LINESIZE*ydim_cpu*sizeof(store_t));
+  // Behind the kernels of the block in the in-order queue, and before
+  // those of the next one which write the same buffer again
+  for(int n = 0; n < nb_slabs; n++) {
+    const struct slab *s = &slabs[n];
+
+    read_rect_async(s->queue, (i % 2 == 0) ? s->d_odata : s->d_idata, snapshot,
+		    s->base, s->left, s->right, s->first, s->last, 0, NULL, &ckpt.read[b][n]);
+    clFlush(s->queue);
+  }
+  ckpt.nb_read[b] = nb_slabs;
+  ckpt.iteration[b] = ckpt.start + i + 1;
+
+  pthread_mutex_lock(&ckpt.lock);
+  ckpt.busy[b] = 1;
+  pthread_cond_broadcast(&ckpt.cond);
+  pthread_mutex_unlock(&ckpt.lock);
+  ckpt.next = (b + 1) % NB_SNAPSHOTS;
+
+  if (!ckpt.running) {
+    if (pthread_create(&ckpt.thread, NULL, checkpoint_thread, NULL) != 0)
+      error("can not start the checkpoint thread\n");
+    ckpt.running = 1;
+  }
+}
+
+/* Appels de libstencil : un seul a la fois, les plans partagent les
+ * threads du CPU, les devices et les parametres courants (par) */
+static pthread_mutex_t api_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Initialisation et fin de libstencil (voir stencil.h) */
+void stencil_options_default(struct stencil_options *o)
+{
+  const struct stencil_options defaults = {
+    .device_type = CL_DEVICE_TYPE_ALL,
+    .affinity = AFFINITY_COMPACT,
+    .driver_core = DRIVER_AUTO,
+    .huge_pages = HUGE_THP,
+  };
+
+  *o = defaults;
+}
+
+/* Reglages du processus selon les options o */
+static void init(const struct stencil_options *o)
+{
+  if (o->threads < 0 || o->affinity < AFFINITY_NONE || o->affinity > AFFINITY_SPREAD ||
+      o->huge_pages < HUGE_NONE || o->huge_pages > HUGE_EXPLICIT ||
+      (o->driver_core < 0 && o->driver_core != DRIVER_NONE && o->driver_core != DRIVER_AUTO))
+    error("invalid stencil_options\n");
+  cpus.threads = o->threads;
+  cpus.affinity = o->affinity;
+  cpus.driver = o->driver_core;
+  arena.huge = o->huge_pages;
+  free(cl_cache);
+  cl_cache = NULL;
+  if (o->cl_cache != NULL && (cl_cache = strdup(o->cl_cache)) == NULL)
+    error("Failed to allocate host memory!\n");
+  cpu_init();
+  select_cpu_kernel(o->cpu_kernel);
+  select_gpu_kernel(o->gpu_kernel);
+  opencl_init(o->device_type);
+}
+
+int stencil_init(const struct stencil_options *o)
+{
+  struct stencil_options defaults;
+  jmp_buf env;
+
+  stencil_options_default(&defaults);
+  pthread_mutex_lock(&api_lock);
+  if (setjmp(env) != 0) {
+    api_error = NULL;
+    pthread_mutex_unlock(&api_lock);
+    return -1;
+  }
+  api_error = &env;
+  init(o != NULL ? o : &defaults);
+  api_error = NULL;
+  pthread_mutex_unlock(&api_lock);
+  return 0;
+}
+
+void stencil_finalize(void)
+{
+  pthread_mutex_lock(&api_lock);
+  if (program != NULL)
+    clReleaseProgram(program);
+  if (nb_devices != 0)
+    clReleaseContext(context);
+  program = NULL;
+  build_options[0] = '\0';
+  nb_devices = 0;
+  free(cl_cache);
+  cl_cache = NULL;
+  arena_release();
+  pthread_mutex_unlock(&api_lock);
+}
+
+/* Plan d'un calcul : ses parametres, le partage entre le CPU et les
+ * devices avec leurs files, noyaux et buffers, et les deux grilles de
+ * l'hote. Tout sert d'une execution a l'autre. */
+struct stencil_plan {
+  struct stencil_params par;
+  struct slab slabs[MAX_DEVICES];       // one per device, top to bottom
+  int nb_slabs;
+  int rows_gpu[MAX_DEVICES];            // height of the slabs
+  int slab_min;                         // smallest slab during the run
+  int ydim_gpu_max;                     // largest GPU part during the run
+  struct balance bal;                   // rates measured by --balance
+  size_t mem_size_gpu;                  // memory allocated on the devices
+  store_t *grid[2];                     // host grids, grid[0] holds the state
+  store_t *rows;                        // --in-place lines of the compute threads
+  int iterations;                       // done by the last execution
+  double residual;                      // its last convergence check, or -1
+};
+
+/* Preparation du plan, dans les parametres courants (par) */
+static void plan_create(struct stencil_plan *plan)
+{
+  int gpu_base;                         // first row held by the device buffers
+  int cols, bands;                      // device grid
+  int widths[MAX_DEVICES];              // of its columns
+  cl_int err;                            // error code returned from api calls
+
+  check_params();
+
+  // The GPU part is cut in one slab per device, each slab keeps at least
+  // SPLIT_STEP rows and enough rows to feed its neighbours' halo. With
+  // --device-columns C the slabs are bands of C devices side by side,
+  // the devices left over are not used. With --balance the device
+  // buffers must be able to hold every split the run may reach, the CPU
+  // also keeps enough rows for the halo.
+  //
+  cols = par.device_columns;
+  if (!par.balance && (par.ydim_gpu == 0 || (par.ydim_gpu == par.ydim && nb_devices == 1)))
+    par.halo = 1;   // Nothing to exchange when a single part does all the work
+  plan->slab_min = ROUND_UP(par.halo, SPLIT_STEP);
+  if (par.balance) {
+    plan->ydim_gpu_max = par.ydim - par.halo;
+    if (plan->ydim_gpu_max > par.ydim / SPLIT_STEP * SPLIT_STEP - par.halo + 1)
+      plan->ydim_gpu_max = par.ydim / SPLIT_STEP * SPLIT_STEP - par.halo + 1;
+    plan->ydim_gpu_max = plan->ydim_gpu_max / SPLIT_STEP * SPLIT_STEP;
+    if (plan->ydim_gpu_max < plan->slab_min)
+      error("the grid is too small for --balance with a halo of %d rows\n", par.halo);
+    plan->nb_slabs = nb_devices;
+    if (par.ydim_gpu < plan->slab_min)
+      par.ydim_gpu = plan->slab_min;
+    if (par.ydim_gpu > plan->ydim_gpu_max)
+      par.ydim_gpu = plan->ydim_gpu_max;
+  } else {
+    plan->ydim_gpu_max = par.ydim_gpu;
+    plan->nb_slabs = (par.ydim_gpu == 0) ? 0 : nb_devices;
+  }
+  plan->nb_slabs = plan->nb_slabs / cols * cols;
+  while (plan->nb_slabs > cols && par.ydim_gpu < plan->nb_slabs / cols * plan->slab_min)
+    plan->nb_slabs -= cols;
+  bands = plan->nb_slabs / cols;
+  if (plan->nb_slabs == 0 && par.ydim_gpu != 0 && nb_devices == 0)
+    error("no OpenCL device found\n");
+  if (plan->nb_slabs == 0 && par.ydim_gpu != 0)
+    error("%u OpenCL devices do not fill %d device columns\n", nb_devices, cols);
+
+  // Between two exchanges each part also computes the ghost rows it will
+  // need for the next steps, the GPU launches are rounded up to whole
+  // work groups
+  //
+  if (par.halo > 1 && plan->nb_slabs != 0 &&
+      (par.ydim_gpu < bands*plan->slab_min ||
+       (par.ydim_gpu != par.ydim &&
+	(par.ydim - par.ydim_gpu < par.halo ||
+	 ROUND_UP(plan->ydim_gpu_max + par.halo - 1, SPLIT_STEP) > par.ydim))))
+    error("a halo of %d rows does not fit this CPU/GPU split\n", par.halo);
+  gpu_base = par.ydim - ROUND_UP(plan->ydim_gpu_max + par.halo - 1, SPLIT_STEP);
+
+  // First split: the bands and the columns are sized by the devices'
+  // peak throughput
+  //
+  if (plan->nb_slabs != 0) {
+    double speed[MAX_DEVICES] = { 0 }, col_speed[MAX_DEVICES] = { 0 };
+
+    for(int s = 0; s < plan->nb_slabs; s++) {
+      speed[s / cols] += device_speed(devices[s]);
+      col_speed[s % cols] += device_speed(devices[s]);
+    }
+    split_rows(par.ydim_gpu, bands, speed, plan->rows_gpu, plan->slab_min, SPLIT_STEP);
+    split_rows(par.xdim, cols, col_speed, widths,
+	       (cols > 1) ? ROUND_UP(par.halo, COL_STEP) : par.xdim, COL_STEP);
+  }
+
+  if (plan->nb_slabs != 0)
+    opencl_build();
+
+  // The host grids are first touched by the threads that compute them
+  //
+  // A grid loaded from a file becomes the state as it is mapped
+  plan->grid[0] = (initial_grid != NULL) ? initial_grid : alloc_grid();
+  initial_grid = NULL;
+  plan->grid[1] = par.in_place ? plan->grid[0] : alloc_grid();
+  if (par.in_place)
+    plan->rows = arena_alloc(4*cpus.threads*LINESIZE*sizeof(store_t));
+
+  // Set up the slabs, stacked from the bottom of the grid
+  //
+  for(int n = 0; n < plan->nb_slabs; n++) {
+    struct slab *s = &plan->slabs[n];
+
+    s->last = par.ydim;
+    for(int b = bands - 1; b > n / cols; b--)
+      s->last -= plan->rows_gpu[b];
+    s->first = s->last - plan->rows_gpu[n / cols];
+    s->left = 0;
+    for(int c = 0; c < n % cols; c++)
+      s->left += widths[c];
+    s->right = s->left + widths[n % cols];
+  }
+  for(int n = 0; n < plan->nb_slabs; n++) {
+    struct slab *s = &plan->slabs[n];
+    size_t size;
+
+    s->device = devices[n];
+
+    // Devices sharing the host memory compute in place in the host grids
+    if (par.zero_copy) {
+      cl_bool unified = CL_FALSE;
+
+      err = clGetDeviceInfo(s->device, CL_DEVICE_HOST_UNIFIED_MEMORY,
+			    sizeof(unified), &unified, NULL);
+      check(err, "Cannot get memory type of device");
+      s->zero_copy = unified;
+    }
+
+    if (s->zero_copy) {
+      s->base = 0;
+      s->end = par.ydim;
+    } else if (par.balance) {
+      s->base = gpu_base;
+      s->end = par.ydim;
+    } else {
+      s->base = (s->first == 0) ? 0 : s->first - ROUND_UP(par.halo - 1, SPLIT_STEP);
+      s->end = (s->last == par.ydim) ? par.ydim : s->last + ROUND_UP(par.halo - 1, SPLIT_STEP);
+    }
+
+    char name[1024];
+    err = clGetDeviceInfo(s->device, CL_DEVICE_NAME, 1024, name, NULL);
+    check(err, "Cannot get type of device");
+
+    s->gk = device_kernel(n);
+    check_kernel(s);
+
+    if (!QUIET) {
+      printf("Device %d : [%s] rows %d to %d", n, name, s->first, s->last);
+      if (cols > 1)
+	printf(", columns %d to %d", s->left, s->right);
+      printf("%s, %s kernel %zux%zu, %d rows per item\n", s->zero_copy ? " (zero-copy)" : "",
+	     s->gk.name, s->gk.local[0], s->gk.local[1], s->gk.rows);
+    }
+
+    // Create a command queue
+    //
+    s->queue = clCreateCommandQueue(context, s->device, CL_QUEUE_PROFILING_ENABLE, &err);
+    check(err,"Failed to create a command queue!\n");
+
+    s->xfer_queue = clCreateCommandQueue(context, s->device, CL_QUEUE_PROFILING_ENABLE, &err);
+    check(err,"Failed to create a command queue!\n");
+
+    // Create the compute kernel in the program we wish to run
+    //
+    s->kernel = clCreateKernel(program, s->gk.entry, &err);
+    check(err, "Failed to create compute kernel!\n");
+
+    if (par.tolerance > 0) {
+      s->residual_kernel = clCreateKernel(program, "residual", &err);
+      check(err, "Failed to create compute kernel!\n");
+      s->reduce_kernel = clCreateKernel(program, "residual_reduce", &err);
+      check(err, "Failed to create compute kernel!\n");
+      s->d_residual = clCreateBuffer(context, CL_MEM_READ_WRITE,
+				     RESIDUAL_GROUPS*sizeof(real_t), NULL, NULL);
+      if (!s->d_residual)
+	error("Failed to allocate device memory!\n");
+    }
+
+    // Create the input and output buffers in device memory for our calculation
+    //
+    size = LINESIZE*(s->end - s->base + 2*BORDER)*sizeof(store_t);
+
+    if (s->zero_copy) {
+      s->d_idata = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+				  size, plan->grid[0], NULL);
+      s->d_odata = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+				  size, plan->grid[1], NULL);
+      if (!s->d_idata || !s->d_odata)
+	error("Failed to allocate device memory!\n");
+      continue;
+    }
+    plan->mem_size_gpu += size;
+
+    s->d_idata = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, NULL);
+    if (!s->d_idata)
+      error("Failed to allocate device memory!\n");
+
+    s->d_odata = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, NULL);
+    if (!s->d_odata)
+      error("Failed to allocate device memory!\n");
+
+  }
+
+  plan->par = par;
+}
+
+/* Liberation d'un plan, aussi quand sa creation s'est arretee en route :
+ * seul ce qui a ete cree est libere */
+static void plan_release(struct stencil_plan *plan)
+{
+  for(int n = 0; n < plan->nb_slabs; n++) {
+    struct slab *s = &plan->slabs[n];
+
+    if (s->d_residual != NULL)
+      clReleaseMemObject(s->d_residual);
+    if (s->reduce_kernel != NULL)
+      clReleaseKernel(s->reduce_kernel);
+    if (s->residual_kernel != NULL)
+      clReleaseKernel(s->residual_kernel);
+    if (s->d_odata != NULL)
+      clReleaseMemObject(s->d_odata);
+    if (s->d_idata != NULL)
+      clReleaseMemObject(s->d_idata);
+    if (s->kernel != NULL)
+      clReleaseKernel(s->kernel);
+    if (s->xfer_queue != NULL)
+      clReleaseCommandQueue(s->xfer_queue);
+    if (s->queue != NULL)
+      clReleaseCommandQueue(s->queue);
+  }
+  arena_free(plan->rows);
+  if (plan->grid[1] != NULL && plan->grid[1] != plan->grid[0])
+    free_grid(plan->grid[1]);
+  if (plan->grid[0] != NULL)
+    free_grid(plan->grid[0]);
+  free(plan);
+}
+
+struct stencil_plan *stencil_plan_create(const struct stencil_params *p)
+{
+  // volatile: still valid after the longjmp() of an error
+  struct stencil_plan *volatile plan = calloc(1, sizeof(*plan));
+  struct stencil_params saved;
+  jmp_buf env;
+
+  if (plan == NULL)
+    return NULL;
+  pthread_mutex_lock(&api_lock);
+  saved = par;
+  if (setjmp(env) != 0) {
+    api_error = NULL;
+    par = saved;
+    plan_release(plan);
+    pthread_mutex_unlock(&api_lock);
+    return NULL;
+  }
+  api_error = &env;
+  par = *p;
+  plan_create(plan);
+  api_error = NULL;
+  par = saved;
+  pthread_mutex_unlock(&api_lock);
+  return plan;
+}
+
+store_t *stencil_grid(const struct stencil_plan *plan)
+{
+  return plan->grid[0];
+}
+
+/* Calcul de num_iteration iterations avec le plan, partage entre le CPU
+ * et les devices, dans ses parametres (par). Renvoie la duree du calcul
+ * en ms. */
+static float execute(struct stencil_plan *plan, store_t *grid, int num_iteration)
+{
+  cl_int err;                            // error code returned from api calls
+
+  struct slab *slabs = plan->slabs;
+  int nb_slabs = plan->nb_slabs;
+
+  store_t *h_idata = plan->grid[0];
+  store_t *h_odata = plan->grid[1];
+
+  struct timeval tv1,tv2;
+  struct timeval tvCPU1,tvCPU2;
+  struct timeval tvGPU1,tvGPU2;
+
+  par.num_iteration = num_iteration;
+
+  // The borders are never computed, both grids take those of the
+  // new state. In place the plan has a single grid.
+  //
+  if (grid != h_idata)
+    memcpy(h_idata, grid, TOTALSIZE*sizeof(store_t));
+  if (h_odata != h_idata)
+    copy_borders(h_odata, h_idata);
+
+  trace_begin();
+  for(int n = 0; n < nb_slabs; n++) {
+    struct slab *s = &slabs[n];
+    char name[32];
+
+    snprintf(name, sizeof(name), "device %d", n);
+    trace_queue(s->queue, name);
+    snprintf(name, sizeof(name), "device %d transfers", n);
+    trace_queue(s->xfer_queue, name);
+
+    if (s->zero_copy)
+      continue;
+
+    // Write our data sets into the device memory, with the lines
+    // bordering the buffers
+    //
+    write_rows(s->queue, s->d_idata, h_idata, s->base, s->base - 1, s->end + 1);
+    write_rows(s->queue, s->d_odata, h_odata, s->base, s->base - 1, s->end + 1);
+  }
+
+  // With --balance the split left by the last run is the starting point
+  int ydim_cpu = (nb_slabs != 0) ? slabs[0].first : par.ydim;
+  int split = (ydim_cpu != 0) + nb_slabs >= 2;
+  int pending = 0;                      // halo exchange in flight
+  double residual = 0.0;                // of the in place pass
+
+  int numIterations = par.num_iteration;
+
+  plan->residual = -1;
+  gettimeofday(&tv1, NULL);
+  for(int i0 = 0, nsteps; i0<numIterations; i0 += nsteps) // Iterations are done inside the kernel
+  {
+    // The parts only depend on each other at the exchanges: the CPU part
+    // goes through up to time_block iterations in a single pass, without
+    // crossing the end of an exchange period
+    nsteps = par.time_block;
+    if (split && nsteps > par.halo - i0 % par.halo)
+      nsteps = par.halo - i0 % par.halo;
+    // A convergence check ends a block
+    if (par.tolerance > 0 && nsteps > par.check_every - i0 % par.check_every)
+      nsteps = par.check_every - i0 % par.check_every;
+    if (nsteps > numIterations - i0)
+      nsteps = numIterations - i0;
+    int i = i0 + nsteps - 1;	// last iteration of the block
+    int check = (par.tolerance > 0 && (i + 1) % par.check_every == 0);
+
+    store_t *h_in = (i0 % 2 == 0) ? h_idata : h_odata;
+    store_t *h_out = (i0 % 2 == 0) ? h_odata : h_idata;
+    store_t *h_last = (nsteps % 2 == 1) ? h_out : h_in;
+
+    // Step in the current exchange period: the ghost rows computed
+    // redundantly shrink by one row per iteration on both sides
+    int ghost = par.halo - 1 - i0 % par.halo;
+    int exchange = (ghost == nsteps - 1 && i != numIterations - 1 && split);
+    int incoming = pending;
+
+    // The CPU exchanges with the first band of slabs, if both have rows
+    int cpu_split = (ydim_cpu != 0 && nb_slabs != 0);
+    int rows_cpu = ydim_cpu + (cpu_split ? ghost : 0);
+    int work_cpu = nsteps*rows_cpu - (cpu_split ? nsteps*(nsteps - 1)/2 : 0);
+    int edge_cpu = ydim_cpu - (exchange ? par.halo : 1);
+    int top_band = cpu_split ? par.device_columns : 0;
+
+    //Compute on GPU lower part
+    gettimeofday(&tvGPU1, NULL);
+    for(int n = 0; n < nb_slabs; n++) {
+      cl_event wait[NB_SIDES*MAX_DEVICES];
+      cl_uint nb_wait = slab_incoming(slabs, nb_slabs, n, wait);
+
+      enqueue_slab(&slabs[n], i0, nsteps, exchange, check, nb_wait, nb_wait ? wait : NULL);
+      if (check)
+	enqueue_residual(&slabs[n], (i % 2 == 0) ? slabs[n].d_odata : slabs[n].d_idata,
+			 (i % 2 == 0) ? slabs[n].d_idata : slabs[n].d_odata);
+    }
+
+    // Between the slabs the halo goes through the host grid, once read
+    // from one slab and once the other one is past its edges. The CPU
+    // still writes ghost rows of h_last during a blocked pass: the edges
+    // landing there are read back after it.
+    if (exchange)
+      exchange_halos(slabs, nb_slabs, h_last, i, (cpu_split && nsteps > 1) ? rows_cpu : 0,
+		     ydim_cpu);
+    for(int n = 0; n < nb_slabs; n++) {
+      clFlush(slabs[n].queue);
+      clFlush(slabs[n].xfer_queue);
+    }
+
+#ifdef COMPUTE_TIME
+    // Wait for the command commands to get serviced before reading back results
+    for(int n = 0; n < nb_slabs; n++)
+      clFinish(slabs[n].queue);
+    gettimeofday(&tvGPU2, NULL);
+#endif
+
+    //Compute on CPU upper part
+    gettimeofday(&tvCPU1, NULL);
+    if (par.in_place)
+      stencil_cpu_inplace(h_in + OFFSET, plan->rows, 0, rows_cpu, check ? &residual : NULL);
+    else if (!cpu_split) {
+      store_t *A[2] = { h_in + OFFSET, h_out + OFFSET };
+
+      if (nsteps > 1)
+	stencil_cpu_blocked(A, rows_cpu, 0, nsteps);
+      else
+	stencil_cpu(h_out + OFFSET, h_in + OFFSET, 0, rows_cpu);
+    } else if (nsteps > 1) {
+      store_t *A[2] = { h_in + OFFSET, h_out + OFFSET };
+
+      // The second iteration overwrites the rows sent at the last
+      // exchange, and the ghost rows read into the host grid
+      if (incoming)
+	for(int n = 0; n < top_band; n++)
+	  for(int h = 0; h < NB_SIDES; h++)
+	    if (slabs[n].halo[h] != NULL && halo_rect(&slabs[n], h).y0 < rows_cpu)
+	      clWaitForEvents(1, &slabs[n].halo[h]);
+      stencil_cpu_blocked(A, rows_cpu, 1, nsteps);
+      if (exchange)
+	for(int n = 0; n < top_band; n++) {
+	  send_halo(&slabs[n], WRITE_TOP, h_last, i, 1, &slabs[n].edge_event);
+	  clFlush(slabs[n].xfer_queue);
+	}
+    } else if (exchange) {
+      if (incoming)
+	for(int n = 0; n < top_band; n++)
+	  clWaitForEvents(1, &slabs[n].halo[READ_TOP]);
+      stencil_cpu(h_out + OFFSET, h_in + OFFSET, edge_cpu, ydim_cpu);
+      // The GPU launches rounded up to work groups also write the
+      // rows above its part: the halo must land after them
+      for(int n = 0; n < top_band; n++) {
+	send_halo(&slabs[n], WRITE_TOP, h_out, i, 1, &slabs[n].edge_event);
+	clFlush(slabs[n].xfer_queue);
+      }
+      stencil_cpu(h_out + OFFSET, h_in + OFFSET, 0, edge_cpu);
+    } else if (incoming) {
+      stencil_cpu(h_out + OFFSET, h_in + OFFSET, 0, edge_cpu);
+      for(int n = 0; n < top_band; n++)
+	clWaitForEvents(1, &slabs[n].halo[READ_TOP]);
+      stencil_cpu(h_out + OFFSET, h_in + OFFSET, edge_cpu, rows_cpu);
+    } else
+      stencil_cpu(h_out + OFFSET, h_in + OFFSET, 0, rows_cpu);
+    gettimeofday(&tvCPU2, NULL);
+
+    // The edges left for after the CPU pass
+    if (exchange && cpu_split && nsteps > 1) {
+      exchange_halos(slabs, nb_slabs, h_last, i, 0, ydim_cpu);
+      for(int n = 0; n < nb_slabs; n++)
+	clFlush(slabs[n].xfer_queue);
+    }
+
+    // The previous exchange is over once the host array it was sent
+    // from can be written again
+    if (incoming) {
+      for(int n = 0; n < nb_slabs; n++)
+	for(int h = 0; h < NB_SIDES; h++)
+	  if (slabs[n].halo[h] != NULL) {
+	    clWaitForEvents(1, &slabs[n].halo[h]);
+	    clReleaseEvent(slabs[n].halo[h]);
+	    slabs[n].halo[h] = NULL;
+	  }
+      pending = 0;
+    }
+
+    // Convergence: each part reduces the norm of its rows' update, the
+    // host only combines one value per part
+    if (check) {
+      double r = par.in_place ? residual :
+	residual_cpu(h_last + OFFSET, ((h_last == h_out) ? h_in : h_out) + OFFSET, 0, ydim_cpu);
+
+      for(int n = 0; n < nb_slabs; n++) {
+	clWaitForEvents(1, &slabs[n].residual_event);
+	clReleaseEvent(slabs[n].residual_event);
+	r = (par.norm == NORM_L2) ? r + slabs[n].residual : max_nan(r, slabs[n].residual);
+      }
+      plan->residual = (par.norm == NORM_L2) ? sqrt(r) : r;
+      // The norm of a grid that has blown up is inf or NaN: not converged
+      if (isfinite(plan->residual) && plan->residual < par.tolerance)
+	numIterations = i + 1;
+    }
+
+    // Each part holds its own rows after every block: a checkpoint
+    // does not have to wait for an exchange
+    if (ckpt.every != 0 && i != numIterations - 1 &&
+	(ckpt.start + i0 + nsteps) / ckpt.every != (ckpt.start + i0) / ckpt.every)
+      checkpoint(slabs, nb_slabs, h_last, ydim_cpu, i);
+
+    if (!exchange)
+      continue;
+    for(int n = 0; n < nb_slabs; n++) {
+      memcpy(slabs[n].halo, slabs[n].next_halo, sizeof(slabs[n].halo));
+      memset(slabs[n].next_halo, 0, sizeof(slabs[n].next_halo));
+    }
+    pending = 1;
+
+    //Deplacement des frontieres entre les parties, au moment des echanges
+    if (par.balance) {
+      int work_gpu[MAX_DEVICES];
+      double time_gpu[MAX_DEVICES];
+
+      for(int n = 0; n < nb_slabs; n++) {
+	struct slab *s = &slabs[n];
+
+	clFinish(s->queue);
+	clFinish(s->xfer_queue);
+	time_gpu[n] = event_time(s->edge_event);
+	for(int t = 0; t < s->nb_timed; t++) {
+	  time_gpu[n] += event_time(s->timed[t]);
+	  clReleaseEvent(s->timed[t]);
+	}
+	work_gpu[n] = s->work;
+      }
+
+      rebalance(&plan->bal, work_cpu, ((float)TIME_DIFF(tvCPU1,tvCPU2)) / 1000,
+		nb_slabs, work_gpu, time_gpu, plan->rows_gpu, plan->slab_min, plan->ydim_gpu_max);
+      move_slabs(slabs, nb_slabs, plan->rows_gpu, h_last, i);
+      ydim_cpu = slabs[0].first;
+    }
+    for(int n = 0; n < nb_slabs; n++)
+      clReleaseEvent(slabs[n].edge_event);
+  }
+  for(int n = 0; n < nb_slabs; n++) {
+    clFinish(slabs[n].queue);
+    clFinish(slabs[n].xfer_queue);
+    // A converged run may stop with an exchange in flight
+    for(int h = 0; h < NB_SIDES; h++)
+      if (slabs[n].halo[h] != NULL) {
+	clReleaseEvent(slabs[n].halo[h]);
+	slabs[n].halo[h] = NULL;
+      }
+  }
+#ifndef COMPUTE_TIME
+  gettimeofday(&tvGPU2, NULL);
+#endif
+  plan->iterations = numIterations;
+  // After an odd number of iterations the result is in the second grid
+  store_t *h_result = (numIterations % 2 == 1) ? h_odata : h_idata;
+
+  gettimeofday(&tv2, NULL);
+  float time1=((float)TIME_DIFF(tv1,tv2)) / 1000;
+
+  checkpoint_wait();
+#ifdef COMPUTE_TIME
+  float timeCPU=((float)TIME_DIFF(tvCPU1,tvCPU2)) / 1000;
+  float timeGPU=((float)TIME_DIFF(tvGPU1,tvGPU2)) / 1000;
+  if (!QUIET) printf("TimeGPU = %f ms, TimeCPU = %f ms ==> TimeLost = %f ms\n", timeGPU, timeCPU, timeGPU-timeCPU);
+#endif
+
+  // Read back the results from the devices to verify the output
+  //
+  for(int n = 0; n < nb_slabs; n++) {
+    struct slab *s = &slabs[n];
+
+    cl_mem d = (numIterations % 2 == 1) ? s->d_odata : s->d_idata;
+
+    if (s->zero_copy) {
+      // Same memory: the mapping only makes the device writes visible
+      void *rows = clEnqueueMapBuffer(s->queue, d, CL_TRUE, CL_MAP_READ,
+				      sizeof(store_t)*LINESIZE*(s->first + 1),
+				      sizeof(store_t)*LINESIZE*(s->last - s->first),
+				      0, NULL, NULL, &err);
+      check(err, "Failed to map matrix!\n");
+      clEnqueueUnmapMemObject(s->queue, d, rows, 0, NULL, NULL);
+      clFinish(s->queue);
+    } else
+      read_rect(s->queue, d, h_result, s->base, s->left, s->right, s->first, s->last);
+    if (par.balance && !QUIET) printf("Device %d : rows %d to %d\n", n, s->first, s->last);
+  }
+  trace_end();
+
+  // The grid holding the result becomes the state of the plan, with
+  // the device buffers mapping it
+  //
+  if (h_result != h_idata) {
+    plan->grid[0] = h_odata;
+    plan->grid[1] = h_idata;
+    for(int n = 0; n < nb_slabs; n++) {
+      cl_mem tmp = slabs[n].d_idata;
+      slabs[n].d_idata = slabs[n].d_odata;
+      slabs[n].d_odata = tmp;
+    }
+  }
+  if (grid != h_idata)
+    memcpy(grid, h_result, TOTALSIZE*sizeof(store_t));
+
+  return time1;
+}
+
+float stencil_execute(struct stencil_plan *plan, store_t *grid, int num_iteration)
+{
+  struct stencil_params saved;
+  float time;
+  jmp_buf env;
+
+  pthread_mutex_lock(&api_lock);
+  saved = par;
+  if (setjmp(env) != 0) {
+    api_error = NULL;
+    // Nothing is left in flight for the plan's destruction
+    for(int n = 0; n < plan->nb_slabs; n++) {
+      clFinish(plan->slabs[n].queue);
+      clFinish(plan->slabs[n].xfer_queue);
+    }
+    checkpoint_wait();
+    par = saved;
+    pthread_mutex_unlock(&api_lock);
+    return -1;
+  }
+  api_error = &env;
+  par = plan->par;
+  time = execute(plan, grid, num_iteration);
+  api_error = NULL;
+  par = saved;
+  pthread_mutex_unlock(&api_lock);
+  return time;
+}
+
+int stencil_iterations(const struct stencil_plan *plan, double *residual)
+{
+  if (residual != NULL)
+    *residual = plan->residual;
+  return plan->iterations;
+}
+
+void stencil_plan_destroy(struct stencil_plan *plan)
+{
+  pthread_mutex_lock(&api_lock);
+  plan_release(plan);
+  pthread_mutex_unlock(&api_lock);
+}
+
+#ifndef STENCIL_LIBRARY
+/* Version cpu pour comparaison : la version de reference, sur un seul
+ * thread, a partir de la grille initiale *grid. Le resultat est dans
+ * *result au retour. Renvoie la duree en ms. */
+static float run_reference(float **grid, float **result)
+{
+  float *h_refdata = *grid;
+  float *reference = *result;
+  struct timeval tv1,tv2;
+
+  for(size_t i = 0; i < TOTALSIZE; i++)
+    reference[i] = h_refdata[i];
+
+  gettimeofday(&tv1,NULL);
+
+  for(int i=0;i<par.num_iteration;i++) {
+    if (i % 2 == 1) {
+      stencil(h_refdata + OFFSET, reference + OFFSET);
+    }
+    else {
+      stencil(reference + OFFSET, h_refdata + OFFSET);
+    }
+  }
+  if (par.num_iteration % 2 == 0) {
+    float* tmp = h_refdata;
+    h_refdata = reference;
+    reference = tmp;
+  }
+
+  gettimeofday(&tv2,NULL);
+  float time2=((float)TIME_DIFF(tv1,tv2)) / 1000;
+
+
+  *grid = h_refdata;
+  *result = reference;
+  return time2;
+}
+
+/* Reference parallele (--validate parallel) : les iterations de
+ * run_reference(), les lignes coupees en bandes entre les threads de
+ * calcul comme dans stencil_cpu(). Meme resultat au bit pres. */
+static float run_reference_parallel(float **grid, float **result)
+{
+  float *ref[2] = { *grid, *result };
+  struct timeval tv1,tv2;
+
+  gettimeofday(&tv1,NULL);
+  #pragma omp parallel num_threads(cpus.team)
+  {
+    int t = cpu_thread(), lo = 0, hi = 0;
+
+    if (t >= 0) {
+      thread_rows(t, 0, par.ydim + 2*BORDER, &lo, &hi);
+      memcpy(ref[1] + lo*LINESIZE, ref[0] + lo*LINESIZE, (hi - lo)*LINESIZE*sizeof(float));
+      thread_rows(t, 0, par.ydim, &lo, &hi);
+    }
+    #pragma omp barrier
+    for(int i = 0; i < par.num_iteration; i++) {
+      for(int y = lo; y < hi; y++)
+	reference_row(ref[(i + 1)%2] + OFFSET + y*LINESIZE, ref[i%2] + OFFSET + y*LINESIZE,
+		      par.xdim, LINESIZE);
+      #pragma omp barrier
+    }
+  }
+  gettimeofday(&tv2,NULL);
+
+  // As run_reference(): the result in *result, the other grid in *grid
+  *grid = ref[(par.num_iteration + 1)%2];
+  *result = ref[par.num_iteration%2];
+  return ((float)TIME_DIFF(tv1,tv2)) / 1000;
+}
+
+/* Reference d'un lot (--batch) : chaque grille de ref[0] avance comme
+ * dans run_reference(), le resultat est dans ref[num_iteration%2].
+ * Renvoie la duree en ms. */
+static float run_reference_batch(float *ref[2], int nb)
+{
+  struct timeval tv1,tv2;
+
+  memcpy(ref[1], ref[0], nb*TOTALSIZE*sizeof(float));
+  gettimeofday(&tv1,NULL);
+  for(int i = 0; i < par.num_iteration; i++)
+    for(int g = 0; g < nb; g++)
+      stencil(ref[(i + 1)%2] + g*TOTALSIZE + OFFSET, ref[i%2] + g*TOTALSIZE + OFFSET);
+  gettimeofday(&tv2,NULL);
+  return ((float)TIME_DIFF(tv1,tv2)) / 1000;
+}
+
+/* Verification du resultat apres un calcul (--validate) : la reference
+ * complete sur un thread (full) ou sur les threads de calcul (parallel),
+ * des tuiles tirees au hasard (sample), l'empreinte d'un calcul
+ * precedent (digest), ou rien */
+enum { VALIDATE_FULL, VALIDATE_PARALLEL, VALIDATE_SAMPLE, VALIDATE_DIGEST, VALIDATE_NONE };
+static const char *validate_names[] = { "full", "parallel", "sample", "digest", "none" };
+
+/* Ecart relatif admis par point */
+static double validate_tolerance(void)
+{
+#if STORAGE == FP16
+  return (par.num_iteration + 1) / 2048.0;  // 2^-11 per rounding
+#elif STORAGE == BF16
+  return (par.num_iteration + 1) / 256.0;   // 2^-8
+#else
+  return 1e-6;
+#endif
+}
+
+/* Comparaison des size premiers points d'un resultat a la reference en
+ * float (TOTALSIZE pour une grille). Renvoie le nombre de points faux,
+ * les premiers sont affiches, et dans *max_error l'ecart relatif maximal.
+ * En FP16 et BF16 l'ecart admis est l'arrondi du format, accumule a
+ * chaque iteration. */
+static unsigned int validate(const float *reference, const store_t *h_odata, size_t size,
+			     double *max_error)
+{
+  double tolerance = validate_tolerance();
+  double max = 0.0, sum = 0.0;
+  unsigned int errors=0;
+  for(size_t i=0;i<size;i++){
+    double out = load_point(h_odata[i]);
+    double e = fabs(reference[i] - out);
+
+    if (reference[i] != 0)
+      e /= fabs(reference[i]);
+    if (e > max)
+      max = e;
+    sum += e*e;
+    if(e > tolerance) {
+      if(errors < 10) printf("[%zu] %f vs %f\n", i, out, reference[i]);
+      errors++;
+    }
+  }
+
+  if (!QUIET) printf("%s vs fp32 reference: max relative error %g, rms %g\n",
+		     storage_names[STORAGE], max, sqrt(sum / size));
+  if (max_error != NULL)
+    *max_error = max;
+  return errors;
+}
+#endif
+
+/* Verification par echantillons (--validate sample) : tiles tuiles d'au
+ * plus SAMPLE_TILE x SAMPLE_TILE points, tirees au hasard, sont
+ * recalculees seules a partir de la grille initiale init (en float). Apres
+ * n iterations une tuile ne depend que des points a moins de n d'elle : son
+ * cone, borne par les bords de la grille, qui perd une ligne et une
+ * colonne de chaque cote par iteration. Les tuiles sont tirees de seed,
+ * que --sample-seed redonne pour rejouer un tirage. Le cout ne depend que de tiles et
+ * de n, pas de la taille de la grille ; il rejoint celui d'un calcul
+ * complet quand 2n depasse la grille. Les tuiles sont partagees entre les
+ * threads de calcul ; elles peuvent se recouvrir, un point faux compte
+ * alors une fois par tuile. Renvoie le nombre de points faux et dans *max_error
+ * l'ecart relatif maximal, comme validate(). */
+#define SAMPLE_TILE 16
+
+#ifndef STENCIL_LIBRARY
+static unsigned int validate_sampled(const float *init, const store_t *h_odata, int tiles,
+				     unsigned int seed, double *max_error)
+{
+  double tolerance = validate_tolerance();
+  int n = par.num_iteration;
+  int tw = (par.xdim < SAMPLE_TILE) ? par.xdim : SAMPLE_TILE;
+  int th = (par.ydim < SAMPLE_TILE) ? par.ydim : SAMPLE_TILE;
+  unsigned int errors = 0;
+  int printed = 0;
+  double max = 0.0;
+
+  if (!QUIET) printf("Sampled validation: %d tiles of %dx%d, seed %u\n", tiles, tw, th, seed);
+
+  #pragma omp parallel num_threads(cpus.team) reduction(+:errors) reduction(max:max)
+  {
+    int t = cpu_thread(), lo = 0, hi = 0;
+    unsigned int r = seed;
+
+    if (t >= 0)
+      thread_rows(t, 0, tiles, &lo, &hi);
+    // Every thread draws the same tiles, then computes its own
+    for(int k = 0; k < hi; k++) {
+      int tx = rand_r(&r) % (par.xdim - tw + 1);
+      int ty = rand_r(&r) % (par.ydim - th + 1);
+      // The cone, and its window with a ring of fixed points around it
+      int x0 = (tx - n > 0) ? tx - n : 0, x1 = (tx + tw + n < par.xdim) ? tx + tw + n : par.xdim;
+      int y0 = (ty - n > 0) ? ty - n : 0, y1 = (ty + th + n < par.ydim) ? ty + th + n : par.ydim;
+      int line = x1 - x0 + 2;
+      float *w[2];
+
+      if (k < lo)
+	continue;
+      w[0] = malloc((y1 - y0 + 2)*line*sizeof(float));
+      w[1] = malloc((y1 - y0 + 2)*line*sizeof(float));
+      if (w[0] == NULL || w[1] == NULL)
+	error("Failed to allocate host memory!\n");
+      for(int y = y0 - 1; y <= y1; y++) {
+	memcpy(w[0] + (y - y0 + 1)*line, init + stencil_point(&par, x0 - 1, y), line*sizeof(float));
+	memcpy(w[1] + (y - y0 + 1)*line, init + stencil_point(&par, x0 - 1, y), line*sizeof(float));
+      }
+
+      // Iteration i only computes the points the tile still needs
+      for(int i = 0; i < n; i++) {
+	int d = n - 1 - i;
+	int cx0 = (tx - d > x0) ? tx - d : x0, cx1 = (tx + tw + d < x1) ? tx + tw + d : x1;
+	int cy0 = (ty - d > y0) ? ty - d : y0, cy1 = (ty + th + d < y1) ? ty + th + d : y1;
+
+	for(int y = cy0; y < cy1; y++)
+	  reference_row(w[(i + 1)%2] + (y - y0 + 1)*line + cx0 - x0 + 1,
+			w[i%2] + (y - y0 + 1)*line + cx0 - x0 + 1, cx1 - cx0, line);
+      }
+
+      for(int y = ty; y < ty + th; y++)
+	for(int x = tx; x < tx + tw; x++) {
+	  size_t i = stencil_point(&par, x, y);
+	  double ref = w[n%2][(y - y0 + 1)*line + x - x0 + 1];
+	  double out = load_point(h_odata[i]);
+	  double e = fabs(ref - out);
+
+	  if (ref != 0)
+	    e /= fabs(ref);
+	  if (e > max)
+	    max = e;
+	  if (e > tolerance) {
+	    int shown;
+
+	    #pragma omp atomic capture
+	    shown = printed++;
+	    if (shown < 10) printf("[%zu] %f vs %f\n", i, out, ref);
+	    errors++;
+	  }
+	}
+      free(w[1]);
+      free(w[0]);
+    }
+  }
+
+  if (!QUIET) printf("%s vs fp32 reference on the samples: max relative error %g\n",
+		     storage_names[STORAGE], max);
+  if (errors)
+    printf("--sample-seed %u replays these tiles\n", seed);
+  if (max_error != NULL)
+    *max_error = max;
+  return errors;
+}
+
+/* Empreinte de reference (--validate digest) : le fichier file garde une
+ * ligne par calcul,
+ *   xdim ydim iterations storage devices halo time_block in_place
+ *   device_columns cpu_kernel slabs checksum
+ * ou les parametres sont ceux du plan (apres ses ajustements), slabs le
+ * noyau et les lignes de chaque tranche (naive:64-128,...), "-" sans
+ * device, et checksum grid_checksum() de la grille finale, en
+ * hexadecimal. L'empreinte est exacte au bit pres : les noyaux vectoriels
+ * du CPU et les devices n'arrondissent pas tous pareil, elle ne se compare
+ * qu'entre calculs faits de la meme facon, comme ceux d'une meme
+ * production ; --balance, qui deplace le partage selon les temps mesures,
+ * n'a donc pas d'empreinte. Un calcul sans ligne dans le fichier est une
+ * erreur, sauf avec record qui l'y ajoute. Renvoie 1 si l'empreinte
+ * differe, 0 sinon. */
+static unsigned int validate_digest(const char *file, const struct stencil_plan *plan,
+				    uint64_t iterations, int record)
+{
+  const struct stencil_params *p = &plan->par;
+  char key[512], line[1024];
+  uint64_t sum = grid_checksum(stencil_grid(plan));
+  size_t len;
+  FILE *f;
+
+  snprintf(key, sizeof(key), "%d %d %lu %s %d %d %d %d %d %s ", p->xdim, p->ydim,
+	   (unsigned long)iterations, storage_names[STORAGE], plan->nb_slabs, p->halo,
+	   p->time_block, p->in_place, p->device_columns, cpu_kernel->name);
+  for(int n = 0; n < plan->nb_slabs; n++) {
+    len = strlen(key);
+    snprintf(key + len, sizeof(key) - len, "%s%s:%d-%d", n ? "," : "",
+	     plan->slabs[n].gk.name, plan->slabs[n].first, plan->slabs[n].last);
+  }
+  strncat(key, plan->nb_slabs ? " " : "- ", sizeof(key) - strlen(key) - 1);
+  len = strlen(key);
+  if ((f = fopen(file, "r")) != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL)
+      if (!strncmp(line, key, len)) {
+	unsigned long long golden;
+
+	fclose(f);
+	if (sscanf(line + len, "%llx", &golden) != 1)
+	  error("%s: bad digest line \"%s\"\n", file, key);
+	if (!QUIET) printf("Digest %016llx, golden %016llx\n", (unsigned long long)sum, golden);
+	if (golden != sum)
+	  printf("digest %016llx vs golden %016llx\n", (unsigned long long)sum, golden);
+	return golden != sum;
+      }
+    fclose(f);
+  }
+
+  if (!record)
+    error("%s has no digest for \"%s\", --golden-record adds it\n", file, key);
+  if ((f = fopen(file, "a")) == NULL)
+    error("can not write %s\n", file);
+  fprintf(f, "%s%016llx\n", key, (unsigned long long)sum);
+  fclose(f);
+  if (!QUIET) printf("Digest %016llx recorded in %s\n", (unsigned long long)sum, file);
+  return 0;
+}
+
+/* Lecture d'avance des lignes [first, last) d'une grille projetee, comme
+ * pour write_rows() */
+static void prefetch_rows(store_t *g, int first, int last)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t start = sizeof(store_t)*LINESIZE*(first + 1) / page * page;
+  size_t end = sizeof(store_t)*LINESIZE*(last + 1);
+
+  if (last > first)
+    madvise((char *)g + start, end - start, MADV_WILLNEED);
+}
+
+/* Tranches de meme hauteur, a SPLIT_STEP lignes pres : la tranche k
+ * commence a la ligne slab_first(k, nb) */
+static int slab_first(int k, int nb)
+{
+  return par.ydim / SPLIT_STEP * k / nb * SPLIT_STEP;
+}
+
+/* Calcul hors memoire (--out-of-core FILE) : la grille reste dans un
+ * fichier de grille projete en memoire ; s'il n'existe pas il est cree
+ * avec la grille initiale habituelle, sinon le calcul reprend a
+ * l'iteration de son en-tete jusqu'a par.num_iteration. Elle
+ * traverse l'hote et le premier device par tranches horizontales d'au
+ * plus par.slab_rows lignes. Chaque tranche est chargee avec ses lignes
+ * fantomes et avance de time_block iterations d'un coup, comme entre deux
+ * echanges de halo (voir enqueue_slab()) : une passe sur le fichier fait
+ * time_block iterations.
+ *
+ * Deux tranches sont en vol : pendant que le device calcule l'une, la
+ * file de transferts rend la precedente a la grille de sortie puis
+ * envoie la suivante, dont les pages sont lues d'avance. La grille de
+ * sortie est un fichier temporaire voisin ; apres un nombre impair de
+ * passes le resultat est recopie dans FILE. Renvoie la duree en ms. */
+static float run_out_of_core(const char *file)
+{
+  struct slab slabs[2];                 // two slabs in flight
+  cl_event loaded[2];
+  store_t *grid[2];
+  int ghost = ROUND_UP(par.time_block - 1, SPLIT_STEP);
+  int rows = par.slab_rows;
+  int nb, height, passes = 0;
+  uint64_t start = 0;
+  size_t size;
+  struct grid_header hd;
+  struct timeval tv1, tv2;
+  cl_int err;
+  int fd, scratch_fd;
+
+  if (nb_devices == 0)
+    error("no OpenCL device found\n");
+
+  // An existing grid file gives the dimensions and the iterations
+  // already done
+  //
+  fd = open(file, O_RDWR);
+  if (fd >= 0) {
+    read_header(fd, file, &hd);
+    start = hd.iteration;
+  }
+  if (start > (uint64_t)par.num_iteration)
+    error("%s is already at iteration %lu\n", file, (unsigned long)start);
+  par.num_iteration -= start;
+  if (par.ydim % SPLIT_STEP != 0 || rows % SPLIT_STEP != 0)
+    error("--out-of-core needs a grid height and slabs multiple of %d rows\n", SPLIT_STEP);
+  par.ydim_gpu = par.ydim;              // every row goes through the device
+  par.balance = 0;
+  check_params();
+
+  // By default the four buffers take half of the device memory
+  //
+  if (rows == 0) {
+    cl_ulong mem, max_alloc;
+
+    err = clGetDeviceInfo(devices[0], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(mem), &mem, NULL);
+    err |= clGetDeviceInfo(devices[0], CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+			   sizeof(max_alloc), &max_alloc, NULL);
+    check(err, "Cannot get memory size of device");
+    if (max_alloc > mem / 8)
+      max_alloc = mem / 8;
+    rows = (int)(max_alloc / (sizeof(store_t)*LINESIZE)) - 2*ghost - 2*BORDER;
+    rows = rows / SPLIT_STEP * SPLIT_STEP;
+  }
+  if (rows > par.ydim)
+    rows = par.ydim;
+  if (rows < SPLIT_STEP)
+    error("the device memory can not hold a slab and its %d ghost rows\n", ghost);
+  nb = (par.ydim + rows - 1) / rows;
+  height = slab_first(nb, nb) - slab_first(nb - 1, nb);   // the highest slab
+  if (nb > 1 && slab_first(1, nb) < ghost)
+    error("slabs of %d rows are too thin for --time-block %d\n", rows, par.time_block);
+
+  // The grid file, and the scratch file for the other grid. The border
+  // lines are never computed, the padding columns come with the rows.
+  //
+  if (fd < 0) {
+    fd = open(file, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 || ftruncate(fd, GRID_HEADER + TOTALSIZE*sizeof(store_t)) < 0)
+      error("can not create %s\n", file);
+    grid[0] = map_grid(fd, file, MAP_SHARED);
+    init_grid(grid[0]);
+  } else {
+    grid[0] = map_grid(fd, file, MAP_SHARED);
+    if (grid_checksum(grid[0]) != hd.checksum)
+      error("%s: wrong checksum\n", file);
+  }
+
+  char scratch[strlen(file) + 8];
+  snprintf(scratch, sizeof(scratch), "%s.XXXXXX", file);
+  scratch_fd = mkstemp(scratch);
+  if (scratch_fd < 0 || ftruncate(scratch_fd, GRID_HEADER + TOTALSIZE*sizeof(store_t)) < 0)
+    error("can not create a scratch file next to %s\n", file);
+  unlink(scratch);
+  grid[1] = map_grid(scratch_fd, scratch, MAP_SHARED);
+  close(scratch_fd);
+  memcpy(grid[1], grid[0], sizeof(store_t)*LINESIZE);
+  memcpy(grid[1] + LINESIZE*(par.ydim + 1), grid[0] + LINESIZE*(par.ydim + 1),
+	 sizeof(store_t)*LINESIZE);
+
+  // Both slabs use the same queues and kernel, each one its buffers
+  //
+  opencl_build();
+  trace_begin();
+  memset(slabs, 0, sizeof(slabs));
+  size = LINESIZE*(height + 2*ghost + 2*BORDER)*sizeof(store_t);
+  for(int n = 0; n < 2; n++) {
+    struct slab *s = &slabs[n];
+
+    s->device = devices[0];
+    s->right = par.xdim;
+    s->gk = device_kernel(0);
+    check_kernel(s);
+    if (n == 0) {
+      s->queue = clCreateCommandQueue(context, s->device, CL_QUEUE_PROFILING_ENABLE, &err);
+      check(err,"Failed to create a command queue!\n");
+      s->xfer_queue = clCreateCommandQueue(context, s->device, CL_QUEUE_PROFILING_ENABLE, &err);
+      check(err,"Failed to create a command queue!\n");
+      s->kernel = clCreateKernel(program, s->gk.entry, &err);
+      check(err, "Failed to create compute kernel!\n");
+      trace_queue(s->queue, "device 0");
+      trace_queue(s->xfer_queue, "device 0 transfers");
+    } else {
+      s->queue = slabs[0].queue;
+      s->xfer_queue = slabs[0].xfer_queue;
+      s->kernel = slabs[0].kernel;
+    }
+    s->d_idata = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, NULL);
+    s->d_odata = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, NULL);
+    if (!s->d_idata || !s->d_odata)
+      error("Failed to allocate device memory!\n");
+  }
+  if (!QUIET) printf("Out of core: %d slabs of %d rows, %d iterations per pass\n",
+		     nb, height, par.time_block);
+
+  gettimeofday(&tv1, NULL);
+  for(int i0 = 0, nsteps; i0 < par.num_iteration; i0 += nsteps, passes++) {
+    store_t *g_in = grid[passes % 2];
+    store_t *g_out = grid[(passes + 1) % 2];
+
+    // The ghost rows shrink to none over the pass
+    nsteps = par.time_block;
+    if (nsteps > par.num_iteration - i0)
+      nsteps = par.num_iteration - i0;
+    par.halo = nsteps;
+
+    // Upload of slab k, once the transfer queue is done with the slab
+    // that used its buffers before, then read ahead of slab k + 1
+    //
+    for(int k = 0; k <= nb; k++) {
+      if (k < nb) {
+	struct slab *s = &slabs[k % 2];
+
+	s->first = slab_first(k, nb);
+	s->last = slab_first(k + 1, nb);
+	s->base = (s->first == 0) ? 0 : s->first - ghost;
+	s->end = (s->last == par.ydim) ? par.ydim : s->last + ghost;
+	write_rows_async(s->xfer_queue, s->d_idata, g_in, s->base, s->base - 1, s->end + 1,
+			 0, NULL, &loaded[k % 2]);
+	clFlush(s->xfer_queue);
+	if (k + 1 < nb) {
+	  int next_end = slab_first(k + 2, nb) + ghost;
+
+	  prefetch_rows(g_in, s->end + 1, (next_end < par.ydim) ? next_end + 1 : par.ydim + 1);
+	}
+      }
+      if (k == 0)
+	continue;
+
+      // Slab k - 1: its iterations, then its rows back to the host
+      //
+      struct slab *s = &slabs[(k - 1) % 2];
+      cl_mem d_last = (nsteps % 2 == 1) ? s->d_odata : s->d_idata;
+
+      // The kernels write neither the border lines nor the padding
+      // columns, which hold the boundary values of each row: the other
+      // buffer gets them on the device rather than through the bus
+      err = clEnqueueWaitForEvents(s->queue, 1, &loaded[(k - 1) % 2]);
+      err |= clEnqueueCopyBuffer(s->queue, s->d_idata, s->d_odata, 0, 0,
+				 sizeof(store_t)*LINESIZE*(s->end - s->base + 2*BORDER),
+				 0, NULL, NULL);
+      check(err, "Failed to copy the slab!\n");
+      enqueue_slab(s, 0, nsteps, 0, 0, 0, NULL);
+      err = clEnqueueMarker(s->queue, &s->edge_event);
+      check(err, "Failed to enqueue marker!\n");
+      clFlush(s->queue);
+
+      read_rows_async(s->xfer_queue, d_last, g_out, s->base, s->first, s->last,
+		      1, &s->edge_event, NULL);
+      clReleaseEvent(loaded[(k - 1) % 2]);
+      clReleaseEvent(s->edge_event);
+    }
+    // The next pass reads the rows written by this one
+    clFinish(slabs[0].queue);
+    clFinish(slabs[0].xfer_queue);
+  }
+  if (passes % 2 == 1)
+    memcpy(grid[0] + LINESIZE, grid[1] + LINESIZE, sizeof(store_t)*LINESIZE*par.ydim);
+  gettimeofday(&tv2, NULL);
+  trace_end();
+  write_header(fd, file, start + par.num_iteration, grid_checksum(grid[0]));
+  close(fd);
+
+  if (!QUIET) printf("%d passes over %s for %d iterations\n", passes, file, par.num_iteration);
+
+  for(int n = 0; n < 2; n++) {
+    clReleaseMemObject(slabs[n].d_odata);
+    clReleaseMemObject(slabs[n].d_idata);
+  }
+  clReleaseKernel(slabs[0].kernel);
+  clReleaseCommandQueue(slabs[0].xfer_queue);
+  clReleaseCommandQueue(slabs[0].queue);
+  munmap(grid[1], TOTALSIZE*sizeof(store_t));
+  munmap(grid[0], TOTALSIZE*sizeof(store_t));
+
+  return ((float)TIME_DIFF(tv1,tv2)) / 1000;
+}
+
+/* Grilles d'un lot (--batch) : nb grilles de TOTALSIZE points l'une
+ * apres l'autre, dont les nb_cpu premieres sont calculees par le CPU.
+ * Comme dans alloc_points(), les threads de calcul touchent les premiers
+ * leur partie, le pilote les grilles des devices. */
+static store_t *alloc_batch(int nb, int nb_cpu)
+{
+  size_t line = LINESIZE*sizeof(store_t);
+  int lines = par.ydim + 2*BORDER;
+  void *h = arena_alloc(nb*TOTALSIZE*sizeof(store_t));
+
+  #pragma omp parallel num_threads(cpus.team)
+  {
+    int t = cpu_thread(), lo, hi;
+
+    if (t >= 0) {
+      thread_rows(t, 0, nb_cpu*lines, &lo, &hi);
+      memset((char *)h + line*lo, 0, line*(hi - lo));
+    }
+    if (t == (cpus.driver >= 0 ? -1 : 0))
+      memset((char *)h + line*nb_cpu*lines, 0, line*(nb - nb_cpu)*lines);
+  }
+  return h;
+}
+
+/* Lot de grilles independantes (--batch N) : nb grilles de par.xdim x
+ * par.ydim points, chacune avec ses bords, dans h[0]. Le CPU calcule les
+ * nb - nb_gpu premieres (stencil_cpu_batch()), les devices les suivantes,
+ * reparties au prorata de device_speed(). Chaque device recoit ses
+ * grilles dans un seul buffer et les fait toutes avancer d'une iteration
+ * par un seul lancement de stencil_batch : une grille de 16x16 ne paie
+ * plus a elle seule un contexte, une compilation, des buffers et un
+ * lancement par iteration. Les grilles ne sont pas coupees et n'echangent
+ * rien, les transferts n'ont lieu qu'au debut et a la fin.
+ * h[1] doit etre une copie de h[0], le resultat est dans
+ * h[par.num_iteration%2]. Renvoie la duree en ms. */
+static float run_batch(store_t *h[2], int nb, int nb_gpu)
+{
+  cl_command_queue queue[MAX_DEVICES];
+  cl_kernel kernel[MAX_DEVICES];
+  cl_mem d_grid[MAX_DEVICES][2];
+  int count[MAX_DEVICES];               // grids of each device
+  double speed[MAX_DEVICES];
+  int nb_cpu = nb - nb_gpu;
+  int nb_dev = (nb_gpu < (int)nb_devices) ? nb_gpu : (int)nb_devices;
+  unsigned int line_size = LINESIZE;
+  unsigned int grid_size = TOTALSIZE;
+  struct timeval tv1, tv2;
+  cl_int err;
+
+  if (nb_gpu > 0 && nb_devices == 0)
+    error("no OpenCL device found\n");
+
+  for(int d = 0; d < nb_dev; d++)
+    speed[d] = device_speed(devices[d]);
+  if (nb_dev != 0) {
+    split_rows(nb_gpu, nb_dev, speed, count, 1, 1);
+    opencl_build();
+  }
+  if (!QUIET) printf("Batch: %d grids of %dx%d, %d on the CPU\n",
+		     nb, par.xdim, par.ydim, nb_cpu);
+
+  for(int d = 0, first = nb_cpu; d < nb_dev; first += count[d], d++) {
+    char name[32];
+
+    queue[d] = clCreateCommandQueue(context, devices[d], CL_QUEUE_PROFILING_ENABLE, &err);
+    check(err,"Failed to create a command queue!\n");
+    kernel[d] = clCreateKernel(program, "stencil_batch", &err);
+    check(err, "Failed to create compute kernel!\n");
+    for(int k = 0; k < 2; k++) {
+      d_grid[d][k] = clCreateBuffer(context, CL_MEM_READ_WRITE,
+				    count[d]*TOTALSIZE*sizeof(store_t), NULL, NULL);
+      if (!d_grid[d][k])
+	error("Failed to allocate device memory!\n");
+    }
+    snprintf(name, sizeof(name), "device %d", d);
+    trace_queue(queue[d], name);
+    if (!QUIET) printf("Device %d: grids %d to %d\n", d, first, first + count[d]);
+  }
+
+  gettimeofday(&tv1, NULL);
+  trace_begin();
+
+  // Everything is queued before the CPU starts on its part
+  //
+  for(int d = 0, first = nb_cpu; d < nb_dev; first += count[d], d++) {
+    size_t size = count[d]*TOTALSIZE*sizeof(store_t);
+    size_t global[3] = { par.xdim, par.ydim, count[d] };
+    cl_event local;
+
+    // The kernel writes neither the borders nor the padding: the other
+    // buffer gets them on the device
+    err = clEnqueueWriteBuffer(queue[d], d_grid[d][0], CL_FALSE, 0, size,
+			       h[0] + first*TOTALSIZE, 0, NULL, trace_event(NULL, &local));
+    check(err, "Failed to write matrix!\n");
+    trace_command(queue[d], PHASE_H2D, "write grids", NULL, local);
+    err = clEnqueueCopyBuffer(queue[d], d_grid[d][0], d_grid[d][1], 0, 0, size, 0, NULL, NULL);
+    check(err, "Failed to copy the grids!\n");
+
+    err = clSetKernelArg(kernel[d], 2, sizeof(unsigned int), &line_size);
+    err |= clSetKernelArg(kernel[d], 3, sizeof(unsigned int), &grid_size);
+    check(err, "Failed to set kernel arguments! %d\n", err);
+    for(int i = 0; i < par.num_iteration; i++) {
+      err = clSetKernelArg(kernel[d], 0, sizeof(cl_mem), &d_grid[d][(i + 1)%2]);
+      err |= clSetKernelArg(kernel[d], 1, sizeof(cl_mem), &d_grid[d][i%2]);
+      check(err, "Failed to set kernel arguments! %d\n", err);
+      // The work groups are left to the runtime: any grid size goes
+      err = clEnqueueNDRangeKernel(queue[d], kernel[d], 3, NULL, global, NULL,
+				   0, NULL, trace_event(NULL, &local));
+      check(err, "Failed to execute kernel!\n");
+      trace_command(queue[d], PHASE_KERNEL, "stencil_batch", NULL, local);
+    }
+
+    err = clEnqueueReadBuffer(queue[d], d_grid[d][par.num_iteration%2], CL_FALSE, 0, size,
+			      h[par.num_iteration%2] + first*TOTALSIZE,
+			      0, NULL, trace_event(NULL, &local));
+    check(err, "Failed to read output matrix!\n");
+    trace_command(queue[d], PHASE_D2H, "read grids", NULL, local);
+    clFlush(queue[d]);
+  }
+
+  if (nb_cpu != 0)
+    stencil_cpu_batch(h, nb_cpu, par.num_iteration);
+  for(int d = 0; d < nb_dev; d++)
+    clFinish(queue[d]);
+  gettimeofday(&tv2, NULL);
+  trace_end();
+
+  for(int d = 0; d < nb_dev; d++) {
+    clReleaseMemObject(d_grid[d][1]);
+    clReleaseMemObject(d_grid[d][0]);
+    clReleaseKernel(kernel[d]);
+    clReleaseCommandQueue(queue[d]);
+  }
+  return ((float)TIME_DIFF(tv1,tv2)) / 1000;
+}
+
+/* Debit memoire de l'hote, mesure comme la triade de STREAM (a = b + s*c
+ * sur des tableaux bien plus grands que les caches, meilleur de 5
+ * mesures), en Go/s. Les noyaux CPU font aussi 3 acces par point : c'est
+ * le plafond de leur debit. */
+static double stream_bandwidth(void)
+{
+  size_t n = 16*1024*1024;
+  float *a, *b, *c;
+  double best = 0.0;
+
+  if (posix_memalign((void **)&a, HOST_ALIGN, n*sizeof(float)) ||
+      posix_memalign((void **)&b, HOST_ALIGN, n*sizeof(float)) ||
+      posix_memalign((void **)&c, HOST_ALIGN, n*sizeof(float)))
+    error("Failed to allocate host memory!\n");
+
+#pragma omp parallel for
+  for(size_t i = 0; i < n; i++) {
+    a[i] = 0.0f;
+    b[i] = 1.0f;
+    c[i] = 2.0f;
+  }
+  for(int r = 0; r < 5; r++) {
+    struct timeval tv1, tv2;
+
+    gettimeofday(&tv1, NULL);
+#pragma omp parallel for
+    for(size_t i = 0; i < n; i++)
+      a[i] = b[i] + 3.0f*c[i];
+    gettimeofday(&tv2, NULL);
+
+    double ms = ((float)TIME_DIFF(tv1,tv2)) / 1000;
+    if (ms > 0 && 3*n*sizeof(float) / ms / 1000000 > best)
+      best = 3*n*sizeof(float) / ms / 1000000;
+  }
+  free(a);
+  free(b);
+  free(c);
+  return best;
+}
+#endif
+
+/* Mode banc d'essai (--bench FILE) : balayage des tailles, nombres
+ * d'iterations, partages et noyaux GPU dans un seul processus. Chaque
+ * point est mesure --repeat fois apres --warmup calculs non mesures, et
+ * compare a une seule execution de la version de reference. Le fichier
+ * garde les trois colonnes de graph.dat (num_iteration, ydim_gpu,
+ * speedup) suivies des mesures, ou est du JSON si son nom finit par
+ * .json. */
+#define MAX_SWEEP 256
+
+struct sweep {
+  int nb;
+  int v[MAX_SWEEP];
+};
+
+struct bench {
+  const char *file;                     // output, "-" for stdout
+  int repeat;                           // measured runs per point
+  int warmup;                           // runs before the measures
+  struct sweep size, iterations, ydim_gpu;   // empty size: --xdim/--ydim
+  const char *kernels[MAX_SWEEP];       // GPU kernels, by name
+  int nb_kernels;
+};
+
+#ifndef STENCIL_LIBRARY
+/* Liste de valeurs : "a,b,c" ou "first:last:step" */
+static void sweep_arg(const char *opt, const char *val, struct sweep *s)
+{
+  int first, last, step;
+  char end;
+
+  if (val == NULL)
+    error("%s expects a value\n", opt);
+  s->nb = 0;
+  if (sscanf(val, "%d:%d:%d%c", &first, &last, &step, &end) == 3) {
+    if (first < 0 || step <= 0 || last < first)
+      error("%s expects first:last:step with 0 <= first <= last and step > 0\n", opt);
+    for(int v = first; v <= last; v += step) {
+      if (s->nb == MAX_SWEEP)
+	error("%s: more than %d values\n", opt, MAX_SWEEP);
+      s->v[s->nb++] = v;
+    }
+    return;
+  }
+  char list[1024];
+  snprintf(list, sizeof(list), "%s", val);
+  for(char *v = strtok(list, ","); v != NULL; v = strtok(NULL, ",")) {
+    if (s->nb == MAX_SWEEP)
+      error("%s: more than %d values\n", opt, MAX_SWEEP);
+    s->v[s->nb++] = int_arg(opt, v);
+  }
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+  float x = *(const float *)a, y = *(const float *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void run_bench(struct bench *b)
+{
+  const struct stencil_params defaults = par;
+  double stream = stream_bandwidth();
+  int json = strlen(b->file) > 5 && !strcmp(b->file + strlen(b->file) - 5, ".json");
+  int nb_points = 0;
+  FILE *out = stdout;
+  char date[64];
+  time_t now;
+
+  if (strcmp(b->file, "-") && (out = fopen(b->file, "w")) == NULL)
+    error("can not open %s\n", b->file);
+
+  time(&now);
+  strftime(date, sizeof(date), "%c", localtime(&now));
+  if (json)
+    fprintf(out, "{\n  \"start\": \"%s\",\n  \"stream_gbs\": %.3f,\n"
+	    "  \"storage\": \"%s\",\n  \"repeat\": %d,\n  \"warmup\": %d,\n  \"points\": [",
+	    date, stream, storage_names[STORAGE], b->repeat, b->warmup);
+  else {
+    fprintf(out, "#MATRIX_SIZE :");
+    for(int s = 0; s < b->size.nb; s++)
+      fprintf(out, " %d", b->size.v[s]);
+    if (b->size.nb == 0)
+      fprintf(out, " %dx%d", par.xdim, par.ydim);
+    fprintf(out, "\n#START : %s\n", date);
+    fprintf(out, "#STREAM : %.3f Go/s (triad)\n", stream);
+    fprintf(out, "#STORAGE : %s\n", storage_names[STORAGE]);
+    fprintf(out, "#REPEAT : %d (warmup %d)\n", b->repeat, b->warmup);
+    fprintf(out, "#num_iteration\tydim_gpu\tspeedup\txdim\tydim\tgpu_kernel"
+	    "\tmedian_ms\tmin_ms\tstddev_ms\tGo/s\tGFLOP/s\tstream_fraction\terrors\tmax_error\n");
+  }
+  fflush(out);
+
+  for(int s = 0; s < b->size.nb || (s == 0 && b->size.nb == 0); s++) {
+    store_t *h_idata;
+    float *h_refdata, *reference;
+
+    par = defaults;
+    if (b->size.nb != 0)
+      par.xdim = par.ydim = b->size.v[s];
+    h_idata = alloc_grid();
+    h_refdata = alloc_reference();
+    reference = alloc_reference();
+
+    for(int it = 0; it < b->iterations.nb; it++) {
+      float time_ref;
+
+      par.num_iteration = b->iterations.v[it];
+      init_grid(h_idata);
+      init_reference(h_refdata, h_idata);
+      time_ref = run_reference(&h_refdata, &reference);
+
+      for(int k = 0; k < b->nb_kernels; k++)
+	for(int g = 0; g < b->ydim_gpu.nb; g++) {
+	  float times[MAX_SWEEP];
+	  double mean = 0.0, var = 0.0;
+	  unsigned int errors;
+	  double max_error;
+	  struct stencil_plan *plan;
+
+	  par = defaults;
+	  if (b->size.nb != 0)
+	    par.xdim = par.ydim = b->size.v[s];
+	  par.num_iteration = b->iterations.v[it];
+	  par.ydim_gpu = b->ydim_gpu.v[g];
+	  select_gpu_kernel(b->kernels[k]);
+	  // Points the grid or the kernel can not take are left out
+	  if (par.ydim_gpu > par.ydim || par.ydim_gpu % SPLIT_STEP != 0 ||
+	      (gpu_kernel != NULL && !kernel_fits(gpu_kernel)))
+	    continue;
+
+	  // One plan per point, executed by every run
+	  // The library has already reported its errors
+	  if ((plan = stencil_plan_create(&par)) == NULL)
+	    exit(EXIT_FAILURE);
+	  for(int r = -b->warmup; r < b->repeat; r++) {
+	    init_grid(stencil_grid(plan));
+	    float ms = stencil_execute(plan, stencil_grid(plan), par.num_iteration);
+	    if (ms < 0)
+	      exit(EXIT_FAILURE);
+	    if (r >= 0)
+	      times[r] = ms;
+	  }
+	  errors = validate(reference, stencil_grid(plan), TOTALSIZE, &max_error);
+	  stencil_plan_destroy(plan);
+
+	  for(int r = 0; r < b->repeat; r++)
+	    mean += times[r] / b->repeat;
+	  for(int r = 0; r < b->repeat; r++)
+	    var += (times[r] - mean)*(times[r] - mean);
+	  if (b->repeat > 1)
+	    var /= b->repeat - 1;
+	  qsort(times, b->repeat, sizeof(float), compare_floats);
+
+	  float median = (b->repeat % 2 == 1) ? times[b->repeat/2] :
+	    (times[b->repeat/2 - 1] + times[b->repeat/2]) / 2;
+	  double gbs = par.num_iteration * 3.0*TOTALSIZE*sizeof(store_t) / median / 1000000;
+	  double gflops = par.num_iteration * 6.0*par.xdim*par.ydim / median / 1000000;
+
+	  if (json)
+	    fprintf(out, "%s\n    { \"num_iteration\": %d, \"ydim_gpu\": %d, \"speedup\": %f,"
+		    " \"xdim\": %d, \"ydim\": %d, \"gpu_kernel\": \"%s\", \"median_ms\": %f, \"min_ms\": %f,"
+		    " \"stddev_ms\": %f, \"gbs\": %f, \"gflops\": %f, \"stream_fraction\": %f,"
+		    " \"errors\": %u, \"max_error\": %g }", nb_points ? "," : "",
+		    par.num_iteration, par.ydim_gpu, time_ref / median, par.xdim, par.ydim,
+		    b->kernels[k], median, times[0], sqrt(var), gbs, gflops,
+		    stream ? gbs / stream : 0.0, errors, max_error);
+	  else
+	    fprintf(out, "%d\t%d\t%f\t%d\t%d\t%s\t%f\t%f\t%f\t%f\t%f\t%f\t%u\t%g\n",
+		    par.num_iteration, par.ydim_gpu, time_ref / median, par.xdim, par.ydim,
+		    b->kernels[k], median, times[0], sqrt(var), gbs, gflops,
+		    stream ? gbs / stream : 0.0, errors, max_error);
+	  fflush(out);
+	  if (errors)
+	    fprintf(stderr, "%d erreurs ! (%dx%d, %d iterations, ydim_gpu %d, %s)\n", errors,
+		    par.xdim, par.ydim, par.num_iteration, par.ydim_gpu, b->kernels[k]);
+	  nb_points++;
+	}
+    }
+    arena_free(reference);
+    arena_free(h_refdata);
+    arena_free(h_idata);
+  }
+
+  time(&now);
+  strftime(date, sizeof(date), "%c", localtime(&now));
+  if (json)
+    fprintf(out, "\n  ],\n  \"end\": \"%s\"\n}\n", date);
+  else
+    fprintf(out, "#END : %s\n", date);
+  if (out != stdout)
+    fclose(out);
+  par = defaults;
+}
+#endif
+
+/* Le programme stencil, absent de libstencil.a (voir le Makefile) */
+#ifndef STENCIL_LIBRARY
+int main(int argc, char** argv)
+{
+  struct stencil_options opt;
+  char cache[1024];
+
+  float *h_refdata = NULL;
+  float *reference = NULL;
+  size_t mem_size = 0;
+  struct stencil_plan *plan;
+
+  const char *out_of_core = NULL;
+  const char *load_file = NULL;
+  int tune = 0;
+  int batch = 0, batch_gpu = -1;
+  int validation = VALIDATE_FULL, sample_tiles = 64;
+  unsigned int sample_seed = time(NULL);
+  const char *golden = NULL;
+  int golden_record = 0;
+  struct bench bench = { .repeat = 5, .warmup = 1 };
+
+  // Filter args
+  //
+  stencil_options_default(&opt);
+  if (default_cache_dir(cache, sizeof(cache)))
+    opt.cl_cache = cache;
+  argv++;
+  while (argc > 1) {
+    if(!strcmp(*argv, "--gpu-only")) {
+      if(opt.device_type != CL_DEVICE_TYPE_ALL)
+	error("--gpu-only and --cpu-only can not be specified at the same time\n");
+      opt.device_type = CL_DEVICE_TYPE_GPU;
+    } else if(!strcmp(*argv, "--cpu-only")) {
+      if(opt.device_type != CL_DEVICE_TYPE_ALL)
+	error("--gpu-only and --cpu-only can not be specified at the same time\n");
+      opt.device_type = CL_DEVICE_TYPE_CPU;
+    } else if(!strcmp(*argv, "--devices")) {
+      par.devices = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--zero-copy")) {
+      par.zero_copy = 1;
+    } else if(!strcmp(*argv, "--device-columns")) {
+      par.device_columns = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--in-place")) {
+      par.in_place = 1;
+    } else if(!strcmp(*argv, "--size")) {
+      par.xdim = par.ydim = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--xdim")) {
+      par.xdim = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--ydim")) {
+      par.ydim = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--ydim-gpu")) {
+      par.ydim_gpu = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--iterations")) {
+      par.num_iteration = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--balance")) {
+      par.balance = 1;
+    } else if(!strcmp(*argv, "--halo")) {
+      par.halo = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--cpu-kernel")) {
+      if (argv[1] == NULL)
+	error("--cpu-kernel expects a value\n");
+      opt.cpu_kernel = argv[1];
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--threads")) {
+      opt.threads = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--affinity")) {
+      if (argv[1] == NULL)
+	error("--affinity expects a value\n");
+      opt.affinity = -1;
+      for(int a = AFFINITY_NONE; a <= AFFINITY_SPREAD; a++)
+	if (!strcmp(argv[1], affinity_names[a]))
+	  opt.affinity = a;
+      if (opt.affinity < 0)
+	error("--affinity expects none, compact or spread\n");
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--driver-core")) {
+      if (argv[1] != NULL && !strcmp(argv[1], "none"))
+	opt.driver_core = DRIVER_NONE;
+      else
+	opt.driver_core = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--huge-pages")) {
+      if (argv[1] == NULL)
+	error("--huge-pages expects a value\n");
+      opt.huge_pages = -1;
+      for(int h = HUGE_NONE; h <= HUGE_EXPLICIT; h++)
+	if (!strcmp(argv[1], huge_names[h]))
+	  opt.huge_pages = h;
+      if (opt.huge_pages < 0)
+	error("--huge-pages expects none, thp or explicit\n");
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--gpu-kernel")) {
+      if (argv[1] == NULL)
+	error("--gpu-kernel expects a value\n");
+      select_gpu_kernel(argv[1]);   // rejects unknown names right away
+      opt.gpu_kernel = argv[1];
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--autotune")) {
+      tune = 1;
+    } else if(!strcmp(*argv, "--bench")) {
+      if (argv[1] == NULL)
+	error("--bench expects a file name\n");
+      bench.file = argv[1];
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--sweep-size")) {
+      sweep_arg(argv[0], argv[1], &bench.size);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--sweep-iterations")) {
+      sweep_arg(argv[0], argv[1], &bench.iterations);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--sweep-ydim-gpu")) {
+      sweep_arg(argv[0], argv[1], &bench.ydim_gpu);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--sweep-gpu-kernel")) {
+      if (argv[1] == NULL)
+	error("--sweep-gpu-kernel expects a value\n");
+      bench.nb_kernels = 0;
+      for(char *k = strtok(argv[1], ","); k != NULL; k = strtok(NULL, ",")) {
+	if (bench.nb_kernels == MAX_SWEEP)
+	  error("--sweep-gpu-kernel: more than %d values\n", MAX_SWEEP);
+	select_gpu_kernel(k);   // rejects unknown names right away
+	bench.kernels[bench.nb_kernels++] = k;
+      }
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--repeat")) {
+      bench.repeat = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--warmup")) {
+      bench.warmup = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--time-block")) {
+      par.time_block = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--tolerance")) {
+      char *end;
+
+      if (argv[1] == NULL)
+	error("--tolerance expects a value\n");
+      par.tolerance = strtod(argv[1], &end);
+      if (*end != '\0' || par.tolerance < 0)
+	error("--tolerance expects a non-negative number, got \"%s\"\n", argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--check-every")) {
+      par.check_every = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--norm")) {
+      if (argv[1] == NULL || (strcmp(argv[1], "max") && strcmp(argv[1], "l2")))
+	error("--norm expects max or l2\n");
+      par.norm = strcmp(argv[1], "max") ? NORM_L2 : NORM_MAX;
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--validate")) {
+      if (argv[1] == NULL)
+	error("--validate expects a value\n");
+      validation = -1;
+      for(int v = VALIDATE_FULL; v <= VALIDATE_NONE; v++)
+	if (!strcmp(argv[1], validate_names[v]))
+	  validation = v;
+      if (validation < 0)
+	error("--validate expects full, parallel, sample, digest or none\n");
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--sample-tiles")) {
+      sample_tiles = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--sample-seed")) {
+      sample_seed = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--golden")) {
+      if (argv[1] == NULL)
+	error("--golden expects a file name\n");
+      golden = argv[1];
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--golden-record")) {
+      golden_record = 1;
+    } else if(!strcmp(*argv, "--load")) {
+      if (argv[1] == NULL)
+	error("--load expects a file name\n");
+      load_file = argv[1];
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--no-checksum")) {
+      grid_verify = 0;
+    } else if(!strcmp(*argv, "--save")) {
+      if (argv[1] == NULL)
+	error("--save expects a file name\n");
+      ckpt.file = argv[1];
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--checkpoint")) {
+      ckpt.every = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--out-of-core")) {
+      if (argv[1] == NULL)
+	error("--out-of-core expects a file name\n");
+      out_of_core = argv[1];
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--slab-rows")) {
+      par.slab_rows = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--batch")) {
+      batch = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--batch-gpu")) {
+      batch_gpu = int_arg(argv[0], argv[1]);
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--cl-cache")) {
+      if (argv[1] == NULL)
+	error("--cl-cache expects a directory\n");
+      opt.cl_cache = strcmp(argv[1], "none") ? argv[1] : NULL;
+      argc--; argv++;
+    } else if(!strcmp(*argv, "--trace")) {
+      if (argv[1] == NULL)
+	error("--trace expects a file name\n");
+      trace_open(argv[1]);
+      argc--; argv++;
+    } else
+      usage();
+    argc--; argv++;
+  }
+
+
+  // The library reports its errors, the program stops on them
+  if (stencil_init(&opt) < 0)
+    exit(EXIT_FAILURE);
+  if (!QUIET) printf("CPU kernel: %s\n", cpu_kernel->name);
+  if (!QUIET) {
+    printf("CPU threads: %d, affinity %s", cpus.threads, affinity_names[cpus.affinity]);
+    if (cpus.driver >= 0)
+      printf(", driver on core %d", cpus.driver);
+    printf("\n");
+  }
+  if (!QUIET) printf("GPU kernel: %s\n", GPU_KERNEL_NAME);
+  if (!QUIET) printf("Storage: %s%s\n", storage_names[STORAGE],
+		     (STORAGE == FP16) ? ", new grids scaled down to fit in half" : "");
+  if (!QUIET) printf("Huge pages: %s\n", huge_names[arena.huge]);
+
+  if (ckpt.every != 0 && ckpt.file == NULL)
+    error("--checkpoint needs a --save file\n");
+  if ((bench.file != NULL || out_of_core != NULL) && (load_file != NULL || ckpt.file != NULL))
+    error("--load and --save do not apply to --bench nor --out-of-core\n");
+  if ((bench.file != NULL || out_of_core != NULL) && par.tolerance > 0)
+    error("--tolerance does not apply to --bench nor --out-of-core\n");
+  if (tune && load_file != NULL)
+    error("--autotune needs the grid size from --xdim, not from --load\n");
+  if (batch != 0 && (bench.file != NULL || out_of_core != NULL || load_file != NULL ||
+		     ckpt.file != NULL || par.tolerance > 0))
+    error("--batch does not apply with --bench, --out-of-core, grid files nor --tolerance\n");
+  if ((validation == VALIDATE_DIGEST) != (golden != NULL))
+    error("--validate digest and --golden FILE go together\n");
+  if (golden_record && golden == NULL)
+    error("--golden-record needs --golden FILE\n");
+  if (validation == VALIDATE_DIGEST && par.balance)
+    error("--validate digest does not apply with --balance, its split depends on the run times\n");
+  if (validation != VALIDATE_FULL && (bench.file != NULL || out_of_core != NULL || batch != 0))
+    error("--validate only applies to a single grid, --bench and --batch keep the full reference\n");
+  if (batch_gpu > batch)
+    error("--batch-gpu expects at most the %d grids of --batch\n", batch);
+
+  if (tune) {
+    check_params();
+    autotune();
+  }
+
+  if (bench.file != NULL) {
+    if (bench.repeat == 0 || bench.repeat > MAX_SWEEP)
+      error("--repeat expects 1 to %d runs\n", MAX_SWEEP);
+    // The sweeps left out keep the value of the other options
+    if (bench.iterations.nb == 0)
+      bench.iterations.v[bench.iterations.nb++] = par.num_iteration;
+    if (bench.ydim_gpu.nb == 0)
+      bench.ydim_gpu.v[bench.ydim_gpu.nb++] = par.ydim_gpu;
+    if (bench.nb_kernels == 0)
+      bench.kernels[bench.nb_kernels++] = GPU_KERNEL_NAME;
+    run_bench(&bench);
+  } else if (batch != 0) {
+    store_t *h[2];
+    float *ref[2];
+    size_t size = batch*TOTALSIZE;
+
+    // Each grid is whole on one side: nothing to split nor exchange
+    par.ydim_gpu = 0;
+    par.balance = 0;
+    par.halo = 1;
+    check_params();
+    if (batch_gpu < 0)
+      batch_gpu = (nb_devices != 0) ? batch : 0;
+    h[0] = alloc_batch(batch, batch - batch_gpu);
+    h[1] = alloc_batch(batch, batch - batch_gpu);
+    init_grids(h[0], batch);
+    memcpy(h[1], h[0], size*sizeof(store_t));
+    ref[0] = arena_alloc(size*sizeof(float));
+    ref[1] = arena_alloc(size*sizeof(float));
+    for(size_t i = 0; i < size; i++)
+      ref[0][i] = load_point(h[0][i]);
+
+    float time1 = run_batch(h, batch, batch_gpu);
+    float time2 = run_reference_batch(ref, batch);
+
+    mem_size = size*sizeof(store_t);
+    if (!QUIET) printf("%f\t%f ms (%fGo/s)\t%f ms (%fGo/s)\n", time2/time1,
+		       time1, par.num_iteration * 3*mem_size / time1 / 1000000,
+		       time2, par.num_iteration * 3*mem_size / time2 / 1000000);
+    else printf("%f\n", time2/time1);
+
+    unsigned int errors = validate(ref[par.num_iteration%2], h[par.num_iteration%2], size, NULL);
+    if(errors)
+      fprintf(stderr,"%d erreurs !\n", errors);
+    else
+      if (!QUIET) fprintf(stderr,"pas d'erreurs, cool !\n");
+
+    arena_free(ref[1]);
+    arena_free(ref[0]);
+    arena_free(h[1]);
+    arena_free(h[0]);
+  } else if (out_of_core != NULL) {
+    float time1 = run_out_of_core(out_of_core);
+
+    mem_size = TOTALSIZE*sizeof(store_t);
+    if (!QUIET) printf("%f ms (%fGo/s)\n", time1,
+		       par.num_iteration * 3*mem_size / time1 / 1000000);
+    else printf("%f\n", time1);
+  } else {
+    // A saved grid goes on up to --iterations
+    if (load_file != NULL)
+      load_grid(load_file, &ckpt.start);
+    if (ckpt.start > (uint64_t)par.num_iteration)
+      error("%s is already at iteration %lu\n", load_file, (unsigned long)ckpt.start);
+    par.num_iteration -= ckpt.start;
+
+    check_params();
+    mem_size = TOTALSIZE*sizeof(store_t);
+
+    // Allocation and initialization of input & output matrices, the
+    // plan computes in place in its own grid
+    //
+    if ((plan = stencil_plan_create(&par)) == NULL)
+      exit(EXIT_FAILURE);
+    if (load_file == NULL)
+      init_grid(stencil_grid(plan));
+    // The reference runs from a copy of the initial grid
+    if (validation <= VALIDATE_SAMPLE) {
+      h_refdata = alloc_reference();
+      init_reference(h_refdata, stencil_grid(plan));
+    }
+    if (validation <= VALIDATE_PARALLEL)
+      reference = alloc_reference();
+
+    float time1 = stencil_execute(plan, stencil_grid(plan), par.num_iteration);
+    if (time1 < 0)
+      exit(EXIT_FAILURE);
+    // The reference and the grid file stop where the run has converged
+    if (par.tolerance > 0) {
+      double residual;
+
+      par.num_iteration = stencil_iterations(plan, &residual);
+      if (!QUIET) printf("%s after %d iterations, update norm %g\n",
+			 (isfinite(residual) && residual >= 0 && residual < par.tolerance) ?
+			 "Converged" : "Not converged",
+			 par.num_iteration, residual);
+    }
+    int numIterations = par.num_iteration;
+    unsigned int errors = 0;
+
+    // Without a full reference there is no speedup to give
+    //
+    if (validation <= VALIDATE_PARALLEL) {
+      float time2 = (validation == VALIDATE_FULL) ?
+	run_reference(&h_refdata, &reference) : run_reference_parallel(&h_refdata, &reference);
+
+      if (!QUIET) printf("%f\t%f ms (%fGo/s)\t%f ms (%fGo/s)\n", time2/time1,
+			 time1, numIterations * 3*mem_size / time1 / 1000000,
+			 time2, numIterations * 3*mem_size / time2 / 1000000);
+      else printf("%f\n", time2/time1);
+    } else {
+      if (!QUIET) printf("%f ms (%fGo/s)\n", time1, numIterations * 3*mem_size / time1 / 1000000);
+      else printf("%f\n", time1);
+    }
+
+    // Validate our results
+    //
+    if (!QUIET) printf("TOTALSIZE = %lu\n", TOTALSIZE);
+    if (!QUIET) printf("TOTALSIZE_GPU = %lu\n", plan->mem_size_gpu/sizeof(store_t));
+    if (!QUIET) printf("LINESIZE = %lu\n", LINESIZE);
+    if (validation <= VALIDATE_PARALLEL)
+      errors = validate(reference, stencil_grid(plan), TOTALSIZE, NULL);
+    else if (validation == VALIDATE_SAMPLE)
+      errors = validate_sampled(h_refdata, stencil_grid(plan), sample_tiles, sample_seed, NULL);
+    else if (validation == VALIDATE_DIGEST)
+      errors = validate_digest(golden, plan, ckpt.start + par.num_iteration, golden_record);
+    if(errors)
+      fprintf(stderr,"%d erreurs !\n", errors);
+    else
+      if (!QUIET && validation != VALIDATE_NONE) fprintf(stderr,"pas d'erreurs, cool !\n");
+
+    if (ckpt.file != NULL)
+      save_grid(ckpt.file, stencil_grid(plan), ckpt.start + par.num_iteration);
+
+    arena_free(reference);
+    arena_free(h_refdata);
+    stencil_plan_destroy(plan);
+  }
+
+  // Shutdown and cleanup
+  //
+  trace_close();
+  stencil_finalize();
+
+  return 0;
+}
+#endif
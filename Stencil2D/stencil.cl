@@ -1,19 +1,322 @@
 
+#ifndef LINESIZE
+#define LINESIZE ((int)line_size)
+#endif
+
+/* Format des points (STORAGE, voir stencil.c). Les grilles sont lues et
+ * ecrites par LOAD/STORE (LOAD4/STORE4 par 4 points) ; les calculs et
+ * les tuiles en memoire locale sont en real : float, double en FP64. */
+#define FP32 0
+#define FP16 1
+#define BF16 2
+#define FP64 3
+#ifndef STORAGE
+#define STORAGE FP32
+#endif
+
+#if STORAGE == FP16
+typedef half store_t;
+typedef float real;
+typedef float4 real4;
+#define LOAD(p, i)      vload_half((i), (p))
+#define STORE(v, p, i)  vstore_half_rte((v), (i), (p))
+#define LOAD4(p, i)     vload_half4(0, (p) + (i))
+#define STORE4(v, p, i) vstore_half4_rte((v), 0, (p) + (i))
+#elif STORAGE == BF16
+// The 16 high bits of a float, rounded to nearest even
+typedef ushort store_t;
+typedef float real;
+typedef float4 real4;
+#define LOAD(p, i)      as_float((uint)(p)[i] << 16)
+#define STORE(v, p, i)  ((p)[i] = (ushort)((as_uint(v) + 0x7fff + ((as_uint(v) >> 16) & 1)) >> 16))
+#define LOAD4(p, i)     as_float4(convert_uint4(vload4(0, (p) + (i))) << 16)
+#define STORE4(v, p, i) vstore4(convert_ushort4((as_uint4(v) + 0x7fff + ((as_uint4(v) >> 16) & 1)) >> 16), 0, (p) + (i))
+#elif STORAGE == FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double store_t;
+typedef double real;
+typedef double4 real4;
+#else
+typedef float store_t;
+typedef float real;
+typedef float4 real4;
+#endif
+
+#ifndef LOAD
+#define LOAD(p, i)      (p)[i]
+#define STORE(v, p, i)  ((p)[i] = (v))
+#define LOAD4(p, i)     vload4(0, (p) + (i))
+#define STORE4(v, p, i) vstore4((v), 0, (p) + (i))
+#endif
+
+/* Version de base : chaque work-item calcule rows lignes d'un point. La
+ * forme des work-groups et rows sont choisis par l'hote (--autotune). */
 __kernel void
-stencil(__global float *B,
-        __global float *A,
-        unsigned int line_size)
+stencil(__global store_t *B,
+        __global store_t *A,
+        unsigned int line_size,
+        unsigned int rows)
+{
+   const int x = get_global_id(0);
+   const int y = get_global_id(1);
+   const int n = rows;
+
+   A += LINESIZE + 16; // OFFSET
+   B += LINESIZE + 16; // OFFSET
+
+   for(int k=0; k<n; k++)
+     STORE(0.75 * LOAD(A, (y*n + k)*LINESIZE + x) +
+           0.25*( LOAD(A, (y*n + k)*LINESIZE + x - 1) +
+                  LOAD(A, (y*n + k)*LINESIZE + x + 1) +
+                  LOAD(A, (y*n + k - 1)*LINESIZE + x) +
+                  LOAD(A, (y*n + k + 1)*LINESIZE + x) ),
+           B, (y*n + k)*LINESIZE + x);
+}
+
+/* Lot de grilles independantes (--batch) : les grilles de grid_size
+ * points se suivent dans les buffers, la dimension 2 du NDRange donne le
+ * numero de la grille. Un point par work-item : toutes les grilles d'un
+ * device avancent d'une iteration en un seul lancement. */
+__kernel void
+stencil_batch(__global store_t *B,
+              __global store_t *A,
+              unsigned int line_size,
+              unsigned int grid_size)
+{
+   const int x = get_global_id(0);
+   const int y = get_global_id(1);
+   const size_t g = get_global_id(2) * (size_t)grid_size + LINESIZE + 16; // OFFSET
+
+   A += g;
+   B += g;
+
+   STORE(0.75 * LOAD(A, y*LINESIZE + x) +
+         0.25*( LOAD(A, y*LINESIZE + x - 1) + LOAD(A, y*LINESIZE + x + 1) +
+                LOAD(A, (y - 1)*LINESIZE + x) + LOAD(A, (y + 1)*LINESIZE + x) ),
+         B, y*LINESIZE + x);
+}
+
+/* Version tuilee : chaque work-group (16x4 work-items, 4 lignes chacun)
+ * charge son bloc de 16x16 points et les bords en memoire locale, chaque
+ * point de A n'est lu qu'une fois en memoire globale par work-group. */
+__kernel __attribute__((reqd_work_group_size(16, 4, 1))) void
+stencil_tiled(__global store_t *B,
+              __global store_t *A,
+              unsigned int line_size)
 {
-   unsigned int x = get_global_id(0);
-   unsigned int y = get_global_id(1);
+   const int x = get_global_id(0);
+   const int y = get_global_id(1);
+   const int xloc = get_local_id(0);
+   const int yloc = get_local_id(1);
+
+   __local real tile[16+2][16+2];
+
+   A += LINESIZE + 16; // OFFSET
+   B += LINESIZE + 16; // OFFSET
+
+   // Copy tile of A into local memory
+   // Begin with inner values
+   for(int k=0; k<4; k++) {
+     tile[yloc*4+k+1][xloc+1] = LOAD(A, (y*4+k)*LINESIZE + x);
+   }
+   // and finish with the borders: each row of work-items loads one side
+   // (right, left, bottom, top), the corners are not used
+
+   {  
+     const int cbx = xloc;
+     const int cby = (yloc & 1) ? -1 : 16;
+     const int bx = (yloc & 2) ? cbx : cby;
+     const int by = (yloc & 2) ? cby : cbx;
+     const int x0 = x - xloc;           // first column of the tile
+     const int y0 = (y - yloc)*4;       // first row of the tile
+
+     tile[by+1][bx+1] = LOAD(A, (y0 + by)*LINESIZE + x0 + bx);
+   }
+
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for(int k=0; k<4; k++) {
+     const int r = yloc*4 + k + 1;
+
+     STORE(0.75 * tile[r][xloc+1] +
+           0.25*( tile[r][xloc] +
+                  tile[r][xloc+2] +
+                  tile[r-1][xloc+1] +
+                  tile[r+1][xloc+1] ),
+           B, (y*4 + k)*LINESIZE + x);
+   }
+}
+
+/* Version vectorisee en x : chaque work-item calcule 4 points sur rows
+ * lignes, les lignes du dessus et du dessous sont reprises d'une ligne a
+ * l'autre. */
+__kernel void
+stencil_float4(__global store_t *B,
+               __global store_t *A,
+               unsigned int line_size,
+               unsigned int rows)
+{
+   const int x = get_global_id(0)*4;
+   const int y = get_global_id(1);
+   const int n = rows;
+
+   A += LINESIZE + 16; // OFFSET
+   B += LINESIZE + 16; // OFFSET
+
+   real4 up = LOAD4(A, (y*n - 1)*LINESIZE + x);
+   real4 center = LOAD4(A, (y*n)*LINESIZE + x);
 
-   A += line_size + 16; // OFFSET
-   B += line_size + 16; // OFFSET
+   for(int k=0; k<n; k++) {
+     const int i = (y*n + k)*LINESIZE + x;
+     const real4 down = LOAD4(A, i + LINESIZE);
+
+     STORE4((real)0.75 * center +
+            (real)0.25*( LOAD4(A, i - 1) + LOAD4(A, i + 1) + up + down ),
+            B, i);
+     up = center;
+     center = down;
+   }
+}
+
+/* Version fusionnee : nsteps iterations (au plus TIME_BLOCK) par
+ * lancement. Chaque work-group charge son bloc de 16 lignes de 64 points
+ * et un halo de TIME_BLOCK points de chaque cote en memoire locale, le
+ * fait avancer en memoire locale puis n'ecrit que le bloc. Le halo est
+ * recalcule par les groupes voisins (trapezes) : la zone calculee perd
+ * un point de chaque cote par iteration. Seuls les points des lignes
+ * [0, ydim) du buffer sont mis a jour : les bords de la grille restent
+ * constants, la premiere ligne du buffer est soit le bord, soit une ligne
+ * fantome dont le resultat n'est plus utilise. Les points hors du buffer
+ * sont pris sur ses bords.
+ * Le noyau ne peut pas ecrire dans le buffer qu'il lit. */
+#ifndef TIME_BLOCK
+#define TIME_BLOCK 1
+#endif
+#define FUSED_H (16 + 2*TIME_BLOCK)
+#define FUSED_W (64 + 2*TIME_BLOCK)
+
+__kernel __attribute__((reqd_work_group_size(16, 4, 1))) void
+stencil_fused(__global store_t *B,
+              __global store_t *A,
+              unsigned int line_size,
+              unsigned int nsteps,
+              unsigned int ydim)
+{
+   const int xloc = get_local_id(0);
+   const int yloc = get_local_id(1);
+   const int lid = yloc*16 + xloc;
+   const int x0 = (get_global_id(0) - xloc)*4;  // first column of the tile
+   const int y0 = (get_global_id(1) - yloc)*4;  // first row of the tile
+   const int xdim = LINESIZE - 16;
+
+   __local real tile[2][FUSED_H][FUSED_W];
+
+   A += LINESIZE + 16; // OFFSET
+   B += LINESIZE + 16; // OFFSET
+
+   // Copy tile of A and its halo into both local arrays
+   for(int i = lid; i < FUSED_H*FUSED_W; i += 64) {
+     const int ty = i / FUSED_W, tx = i % FUSED_W;
+     const int gy = clamp(y0 + ty - TIME_BLOCK, -1, (int)ydim);
+     const int gx = clamp(x0 + tx - TIME_BLOCK, -1, xdim);
+
+     tile[0][ty][tx] = tile[1][ty][tx] = LOAD(A, gy*LINESIZE + gx);
+   }
+
+   for(int s = 1; s <= (int)nsteps; s++) {
+     // Points still needed by the remaining iterations
+     const int m = TIME_BLOCK - (int)nsteps + s;
+     const int h = FUSED_H - 2*m, w = FUSED_W - 2*m;
+     const int src = (s - 1) & 1, dst = s & 1;
+
+     barrier(CLK_LOCAL_MEM_FENCE);
+     for(int i = lid; i < h*w; i += 64) {
+       const int ty = m + i / w, tx = m + i % w;
+       const int gy = y0 + ty - TIME_BLOCK, gx = x0 + tx - TIME_BLOCK;
+
+       if (gx >= 0 && gx < xdim && gy >= 0 && gy < (int)ydim)
+         tile[dst][ty][tx] = 0.75 * tile[src][ty][tx] +
+                             0.25*( tile[src][ty][tx-1] + tile[src][ty][tx+1] +
+                                    tile[src][ty-1][tx] + tile[src][ty+1][tx] );
+     }
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
 
    for(int k=0; k<4; k++)
-     B[(y*4 + k)*line_size + x] = 0.75 * A[(y*4 + k)*line_size + x ] +
-                                  0.25*( A[(y*4 + k)*line_size + x - 1 ] +
-				         A[(y*4 + k)*line_size + x + 1] +
-                                         A[(y*4 + k - 1)*line_size + x ] +
-					 A[(y*4 + k + 1)*line_size + x ] );
+     for(int c=0; c<4; c++) {
+       const int r = yloc*4 + k, col = c*16 + xloc;
+
+       STORE(tile[nsteps & 1][r + TIME_BLOCK][col + TIME_BLOCK],
+             B, (y0 + r)*LINESIZE + x0 + col);
+     }
+}
+
+/* Norme de la mise a jour B - A sur les colonnes [left, left + columns)
+ * des lignes [first, first + rows) du buffer, pour la convergence :
+ * max |B - A|, ou la somme des carres avec l2. Chaque work-group reduit
+ * ses points en memoire locale et ecrit son resultat dans
+ * partial[groupe] ; residual_reduce() reduit ensuite ces resultats dans
+ * partial[0], la seule valeur relue par l'hote. Le maximum garde NaN, que
+ * max() laisse de cote : une grille qui a diverge ne semble pas
+ * convergee. */
+#define RESIDUAL_GROUP 64
+#define MAX_NAN(a, b) ((isnan(b) || (b) > (a)) ? (b) : (a))
+
+__kernel __attribute__((reqd_work_group_size(RESIDUAL_GROUP, 1, 1))) void
+residual(__global store_t *B,
+         __global store_t *A,
+         unsigned int line_size,
+         unsigned int left,
+         unsigned int columns,
+         unsigned int first,
+         unsigned int rows,
+         unsigned int l2,
+         __global real *partial)
+{
+   const int lid = get_local_id(0);
+   real r = 0;
+
+   __local real sum[RESIDUAL_GROUP];
+
+   A += LINESIZE + 16; // OFFSET
+   B += LINESIZE + 16; // OFFSET
+
+   for(unsigned int i = get_global_id(0); i < rows*columns; i += get_global_size(0)) {
+     const int p = (first + i / columns)*LINESIZE + left + i % columns;
+     const real d = LOAD(B, p) - LOAD(A, p);
+
+     r = l2 ? r + d*d : MAX_NAN(r, fabs(d));
+   }
+   sum[lid] = r;
+
+   for(int s = RESIDUAL_GROUP/2; s > 0; s /= 2) {
+     barrier(CLK_LOCAL_MEM_FENCE);
+     if (lid < s)
+       sum[lid] = l2 ? sum[lid] + sum[lid + s] : MAX_NAN(sum[lid], sum[lid + s]);
+   }
+   if (lid == 0)
+     partial[get_group_id(0)] = sum[0];
+}
+
+__kernel __attribute__((reqd_work_group_size(RESIDUAL_GROUP, 1, 1))) void
+residual_reduce(__global real *partial,
+                unsigned int n,
+                unsigned int l2)
+{
+   const int lid = get_local_id(0);
+   real r = 0;
+
+   __local real sum[RESIDUAL_GROUP];
+
+   for(unsigned int i = lid; i < n; i += RESIDUAL_GROUP)
+     r = l2 ? r + partial[i] : MAX_NAN(r, partial[i]);
+   sum[lid] = r;
+
+   for(int s = RESIDUAL_GROUP/2; s > 0; s /= 2) {
+     barrier(CLK_LOCAL_MEM_FENCE);
+     if (lid < s)
+       sum[lid] = l2 ? sum[lid] + sum[lid + s] : MAX_NAN(sum[lid], sum[lid + s]);
+   }
+   if (lid == 0)
+     partial[0] = sum[0];
 }
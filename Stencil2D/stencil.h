@@ -0,0 +1,157 @@
+#ifndef STENCIL_H
+#define STENCIL_H
+
+/* libstencil : le calcul de stencil.c (partage CPU/devices OpenCL) pour
+ * un autre programme. Comme avec FFTW, un plan prepare une fois pour
+ * toutes ce qui est couteux (choix et partage des devices, compilation
+ * de stencil.cl, buffers, grilles de l'hote) ; chaque execution ne fait
+ * ensuite que transferer la grille et iterer.
+ *
+ *   stencil_options_default(&o);
+ *   o.threads = 8;
+ *   if (stencil_init(&o) < 0)
+ *     ...
+ *   stencil_params_default(&p);
+ *   p.xdim = p.ydim = 8192;
+ *   if ((plan = stencil_plan_create(&p)) == NULL)
+ *     ...
+ *   ... remplir stencil_grid(plan) ...
+ *   for (...)
+ *     stencil_execute(plan, stencil_grid(plan), 10);
+ *   stencil_plan_destroy(plan);
+ *   stencil_finalize();
+ *
+ * Une erreur, parametres invalides ou echec d'OpenCL, est signalee sur
+ * stderr comme dans stencil, et l'appel renvoie une erreur sans arreter
+ * le programme. Les appels peuvent venir de plusieurs threads mais ne
+ * s'executent qu'un a la fois : les plans se partagent les threads de
+ * calcul du CPU et les devices. */
+
+#include <stdint.h>
+#include <CL/opencl.h>
+
+/* Format des points des grilles, choisi a la compilation comme QUIET
+ * (make DEFINES="-DSTORAGE=FP16", STORAGE et FP16 etant les noms courts
+ * de STENCIL_STORAGE et STENCIL_FP16 dans stencil.c) et passe tel quel a
+ * stencil.cl. En FP16 et BF16 les points sont stockes sur 16 bits et
+ * convertis en float pour le calcul : deux fois moins d'octets a deplacer
+ * pour un noyau limite par la memoire. En FP64 stockage et calcul sont en
+ * double. La reference (stencil()) reste en float dans tous les cas,
+ * validate() donne l'erreur du format choisi par rapport a elle.
+ * Un programme lie a libstencil.a doit etre compile avec le meme format
+ * (-DSTENCIL_STORAGE=STENCIL_FP16). */
+#define STENCIL_FP32 0
+#define STENCIL_FP16 1
+#define STENCIL_BF16 2
+#define STENCIL_FP64 3
+#ifndef STENCIL_STORAGE
+	#define STENCIL_STORAGE STENCIL_FP32
+#endif
+
+#if STENCIL_STORAGE == STENCIL_FP16 || STENCIL_STORAGE == STENCIL_BF16
+typedef uint16_t stencil_store_t;
+#elif STENCIL_STORAGE == STENCIL_FP64
+typedef double stencil_store_t;
+#else
+typedef float stencil_store_t;
+#endif
+
+/* Parametres du calcul. Les macros XDIM, YDIM... de stencil.c ne donnent
+ * que les valeurs par defaut, elles peuvent etre changees en ligne de
+ * commande (voir usage()) sans recompiler. */
+struct stencil_params {
+  int xdim;                             // grid width (without borders)
+  int ydim;                             // grid height (without borders)
+  int ydim_gpu;                         // rows computed by the OpenCL device
+  int num_iteration;
+  int balance;                          // move the CPU/GPU split during the run
+  int halo;                             // ghost rows exchanged every halo steps
+  int time_block;                       // CPU iterations per pass through memory
+  int devices;                          // OpenCL devices used, 0 for all
+  int zero_copy;                        // share the host grid with the devices
+  int slab_rows;                        // out of core slab height, 0 for auto
+  double tolerance;                     // stop once the update is below, 0 never
+  int check_every;                      // iterations between two convergence checks
+  int norm;                             // STENCIL_NORM_MAX or STENCIL_NORM_L2
+  int device_columns;                   // columns of the device grid, 1 for slabs
+  int in_place;                         // one host grid, updated in place by the CPU
+};
+
+/* Normes de la mise a jour B - A d'une iteration, pour la convergence */
+enum { STENCIL_NORM_MAX, STENCIL_NORM_L2 };
+
+/* Position du point (x, y) dans une grille. Les bords, x = -1, x = xdim,
+ * y = -1 et y = ydim, sont des valeurs fixes : ils ne sont jamais
+ * recalcules. Une grille a (xdim + 16)*(ydim + 2) points. */
+static inline size_t stencil_point(const struct stencil_params *p, int x, int y)
+{
+  return (size_t)(p->xdim + 16)*(y + 1) + 16 + x;
+}
+
+struct stencil_plan;
+
+/* Options du processus, communes a tous les plans : celles de stencil
+ * qui ne changent pas d'un calcul a l'autre (--threads, --affinity...).
+ * Sans repertoire cl_cache, les programmes compiles et les reglages de
+ * --autotune ne sont ni lus ni ecrits. */
+struct stencil_options {
+  cl_device_type device_type;           // OpenCL devices used
+  const char *cpu_kernel;               // CPU kernel, NULL for the widest supported
+  const char *gpu_kernel;               // GPU kernel variant, NULL for the tuned one
+  int threads;                          // CPU compute threads, 0 for one per core
+  int affinity;                         // STENCIL_AFFINITY_*, placement of the threads
+  int driver_core;                      // core of the driver thread, or STENCIL_DRIVER_*
+  int huge_pages;                       // STENCIL_HUGE_*, pages of the host grids
+  const char *cl_cache;                 // cache directory, NULL for no cache
+};
+
+enum { STENCIL_AFFINITY_NONE, STENCIL_AFFINITY_COMPACT, STENCIL_AFFINITY_SPREAD };
+enum { STENCIL_HUGE_NONE, STENCIL_HUGE_THP, STENCIL_HUGE_EXPLICIT };
+#define STENCIL_DRIVER_NONE (-1)        // no driver core, the driver also computes
+#define STENCIL_DRIVER_AUTO (-2)        // the first core of the process
+
+/* Options par defaut, celles de stencil sans option mais sans cache */
+void stencil_options_default(struct stencil_options *o);
+
+/* Initialisation du processus, avant le premier plan : threads de calcul
+ * du CPU, noyaux et devices OpenCL selon les options o (NULL pour celles
+ * par defaut). Le source des noyaux est lu dans $STENCIL_CL, ou
+ * stencil.cl dans le repertoire courant. Renvoie 0, ou -1 en cas
+ * d'erreur. */
+int stencil_init(const struct stencil_options *o);
+
+/* Liberation de l'environnement OpenCL, apres le dernier plan */
+void stencil_finalize(void);
+
+/* Parametres par defaut, ceux de stencil sans option */
+void stencil_params_default(struct stencil_params *p);
+
+/* Preparation d'un calcul de parametres p (num_iteration n'y compte
+ * pas) : partage de la grille, compilation, files de commandes, buffers
+ * des devices et grilles de l'hote. Avec p->balance le partage trouve
+ * par une execution sert de depart a la suivante. Renvoie NULL en cas
+ * d'erreur. */
+struct stencil_plan *stencil_plan_create(const struct stencil_params *p);
+
+/* Grille du plan : celle que stencil_execute() calcule sur place, sans
+ * copie. Le resultat d'une execution est dans le nouveau stencil_grid(),
+ * le pointeur peut changer a chaque fois. */
+stencil_store_t *stencil_grid(const struct stencil_plan *plan);
+
+/* num_iteration iterations a partir de grid, ou moins avec une
+ * tolerance : le calcul s'arrete a la premiere verification ou la norme
+ * de la mise a jour est plus petite ; une norme inf ou NaN (la grille a
+ * diverge) ne l'est jamais. Une autre grille que
+ * stencil_grid(plan) est copiee a l'aller et contient le resultat au
+ * retour. Renvoie la duree du calcul en ms, ou -1 en cas d'erreur : le
+ * contenu des grilles n'est alors plus defini, le plan ne peut plus
+ * qu'etre detruit. */
+float stencil_execute(struct stencil_plan *plan, stencil_store_t *grid, int num_iteration);
+
+/* Nombre d'iterations de la derniere execution, et la derniere norme
+ * calculee dans *residual (s'il n'est pas NULL, -1 sans verification) */
+int stencil_iterations(const struct stencil_plan *plan, double *residual);
+
+void stencil_plan_destroy(struct stencil_plan *plan);
+
+#endif
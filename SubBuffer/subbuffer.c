@@ -270,29 +270,62 @@ int main(int argc, char** argv)
       check(err, "Failed to transfer input matrix!\n");
     }
 
-    /* Le code suivant ne fonctionne pas au CREMI au jour du 16/04/2012 :) */
-
-    /* { */
-    /*   float line[XDIM] = { 999.0, 999.0, 999.0, 999.0, 999.0, 999.0, 999.0, 999.0, */
-    /* 			   999.0, 999.0, 999.0, 999.0, 999.0, 999.0, 999.0, 999.0 }; */
-    /*   size_t buffer_origin[3] = { OFFSET*sizeof(float), 15, 0}; */
-    /*   size_t host_origin[3] = { 0, 0, 0 }; */
-    /*   size_t region[3] = { sizeof(line), 1, 1 }; */
-
-    /*   err = clEnqueueWriteBufferRect(queue, d_odata, CL_TRUE, */
-    /* 				     buffer_origin, */
-    /* 				     host_origin, */
-    /* 				     region, */
-    /* 				     LINESIZE*sizeof(float),  */
-    /* 				     0,        */
-    /* 				     0,        */
-    /* 				     0,        */
-    /* 				     line,     */
-    /* 				     0, NULL, NULL); */
-    /*   check(err, "Failed to write one-line buffer!\n"); */
-    /* } */
-
-
+    /* clEnqueueWriteBufferRect() et clCreateSubBuffer() sont apparus avec
+     * OpenCL 1.1 : le runtime du CREMI au 16/04/2012, en 1.0, ne les
+     * avait pas. L'appel etait juste, il est fait quand le device les
+     * connait. */
+    char version[128] = "";
+    int major = 1, minor = 0;
+
+    err = clGetDeviceInfo(devices[dev], CL_DEVICE_VERSION, sizeof(version), version, NULL);
+    check(err, "Cannot get version of device");
+    sscanf(version, "OpenCL %d.%d", &major, &minor);
+
+#ifdef CL_VERSION_1_1
+    if (major > 1 || minor >= 1) {
+      // Overwrite the first 8 points of row 14 with a rectangle of one line
+      float points[8] = { 888.0, 888.0, 888.0, 888.0, 888.0, 888.0, 888.0, 888.0 };
+      size_t buffer_origin[3] = { OFFSET*sizeof(float), 14, 0 };
+      size_t host_origin[3] = { 0, 0, 0 };
+      size_t region[3] = { sizeof(points), 1, 1 };
+
+      err = clEnqueueWriteBufferRect(queue, d_odata, CL_TRUE,
+				     buffer_origin,
+				     host_origin,
+				     region,
+				     LINESIZE*sizeof(float),
+				     0,
+				     0,
+				     0,
+				     points,
+				     0, NULL, NULL);
+      check(err, "Failed to write one-line buffer!\n");
+
+      // Then the last 8 points of row 13 through a sub-buffer of its
+      // line. A sub-buffer starts at a multiple of
+      // CL_DEVICE_MEM_BASE_ADDR_ALIGN (in bits): here a whole line.
+      cl_uint align = 0;
+      cl_buffer_region line = { sizeof(float)*LINESIZE*(13 + 1), sizeof(float)*LINESIZE };
+      cl_mem d_line;
+
+      err = clGetDeviceInfo(devices[dev], CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+			    sizeof(align), &align, NULL);
+      check(err, "Cannot get alignment of device");
+      // A runtime may report no alignment (0), or one below a byte
+      if (align >= 8 && line.origin % (align/8) == 0) {
+	d_line = clCreateSubBuffer(d_odata, CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION,
+				   &line, &err);
+	check(err, "Failed to create sub-buffer!\n");
+	err = clEnqueueWriteBuffer(queue, d_line, CL_TRUE, sizeof(float)*(16 + 8),
+				   sizeof(points), points, 0, NULL, NULL);
+	check(err, "Failed to write sub-buffer!\n");
+	clReleaseMemObject(d_line);
+      } else if (align >= 8)
+	printf("Line 13 is not aligned on %u bits, no sub-buffer\n", align);
+      else
+	printf("Base address alignment of %u bits, no sub-buffer\n", align);
+    }
+#endif
 
     // Read back the results from the device to verify the output
     //